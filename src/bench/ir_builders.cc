@@ -0,0 +1,151 @@
+/*
+  Synthetic modules, shared by the benchmark and the generator.
+
+  Every function has the type i32 (i32), and the same body layout, each part
+  being optional:
+
+    entry
+      loop nest headers        loopDepth loops, counting up to the argument
+        if-then diamonds       diamonds of them, storing to a global
+        switch                 switchWidth cases, each storing to the global
+        calls                  to the function of the next one in the
+                               recursion cycle, then fanOut callees
+      loop nest latches and exits
+    ret
+
+  Callees are drawn among the callWindow functions following the caller, so
+  the calls without recursion form a DAG: a window of 1 gives a chain, a
+  window as large as the module a dense random graph. main calls every
+  function nobody else calls. The same shape and seed give the same module.
+*/
+
+/// IRShape - Parameters of a synthetic module.
+struct IRShape {
+    unsigned functions = 1;   // Functions besides main.
+    unsigned diamonds = 0;    // If-then diamonds per function.
+    unsigned loopDepth = 0;   // Depth of the loop nest around each body.
+    unsigned switchWidth = 0; // Cases of the switch of each function, 0 for none.
+    unsigned fanOut = 0;      // Calls per function.
+    unsigned callWindow = 1;  // Callees are among the next callWindow functions.
+    unsigned cycleLength = 0; // Length of the recursion cycles, 0 for none.
+    uint64_t seed = 1;
+};
+
+/// ShapeRandom - Small, portable random number generator (splitmix64), so
+/// that a seed gives the same module with every standard library.
+class ShapeRandom {
+public:
+    explicit ShapeRandom(uint64_t seed) : state_(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    unsigned below(unsigned bound) { return next() % bound; }
+
+private:
+    uint64_t state_;
+};
+
+/// buildBody - Fill the body of a function of the given shape, calling callees.
+static void buildBody(Function *func, GlobalVariable *global, const IRShape &shape, ArrayRef<Function *> callees) {
+    LLVMContext &context = func->getContext();
+    IRBuilder<> builder {BasicBlock::Create(context, "entry", func)};
+    Value *x = func->getArg(0);
+
+    // Loop headers, outermost first.
+    SmallVector<PHINode *, 8> inductions {};
+    for (unsigned d = 0; d < shape.loopDepth; ++d) {
+        BasicBlock *preheader = builder.GetInsertBlock();
+        BasicBlock *header = BasicBlock::Create(context, "loop", func);
+        builder.CreateBr(header);
+        builder.SetInsertPoint(header);
+        PHINode *induction = builder.CreatePHI(builder.getInt32Ty(), 2, "i");
+        induction->addIncoming(builder.getInt32(0), preheader);
+        inductions.push_back(induction);
+    }
+
+    for (unsigned i = 0; i < shape.diamonds; ++i) {
+        BasicBlock *then = BasicBlock::Create(context, "then", func);
+        BasicBlock *merge = BasicBlock::Create(context, "merge", func);
+        builder.CreateCondBr(builder.CreateICmpSGT(x, builder.getInt32(i)), then, merge);
+        builder.SetInsertPoint(then);
+        builder.CreateStore(builder.getInt32(i), global);
+        builder.CreateBr(merge);
+        builder.SetInsertPoint(merge);
+    }
+
+    if (shape.switchWidth) {
+        BasicBlock *otherwise = BasicBlock::Create(context, "default", func);
+        BasicBlock *join = BasicBlock::Create(context, "join", func);
+        SwitchInst *branch = builder.CreateSwitch(x, otherwise, shape.switchWidth);
+        for (unsigned c = 0; c < shape.switchWidth; ++c) {
+            BasicBlock *target = BasicBlock::Create(context, "case", func);
+            branch->addCase(builder.getInt32(c), target);
+            IRBuilder<> caseBuilder {target};
+            caseBuilder.CreateStore(caseBuilder.getInt32(c), global);
+            caseBuilder.CreateBr(join);
+        }
+        IRBuilder<> {otherwise}.CreateBr(join);
+        builder.SetInsertPoint(join);
+    }
+
+    for (Function *callee : callees)
+        builder.CreateCall(callee, {x});
+
+    // Latches, innermost first.
+    for (unsigned d = shape.loopDepth; d-- > 0;) {
+        PHINode *induction = inductions[d];
+        Value *next = builder.CreateAdd(induction, builder.getInt32(1));
+        BasicBlock *exit = BasicBlock::Create(context, "exit", func);
+        induction->addIncoming(next, builder.GetInsertBlock());
+        builder.CreateCondBr(builder.CreateICmpSLT(next, x), induction->getParent(), exit);
+        builder.SetInsertPoint(exit);
+    }
+    builder.CreateRet(x);
+}
+
+/// buildModule - Build a module of the given shape.
+static std::unique_ptr<Module> buildModule(LLVMContext &context, const IRShape &shape) {
+    auto module = std::make_unique<Module>("synthetic", context);
+    Type *i32 = Type::getInt32Ty(context);
+    FunctionType *type = FunctionType::get(i32, {i32}, false);
+    auto *global = new GlobalVariable(*module, i32, false, GlobalValue::InternalLinkage,
+                                      ConstantInt::get(i32, 0), "g");
+
+    vector<Function *> functions(shape.functions);
+    for (unsigned f = 0; f < shape.functions; ++f)
+        functions[f] = Function::Create(type, GlobalValue::InternalLinkage, "f" + Twine(f), *module);
+
+    ShapeRandom random {shape.seed};
+    BitVector called(shape.functions);
+    SmallVector<Function *, 8> callees {};
+    for (unsigned f = 0; f < shape.functions; ++f) {
+        callees.clear();
+        if (shape.cycleLength) {// Next function of the cycle, itself for cycles of 1.
+            unsigned first = f - f % shape.cycleLength;
+            unsigned length = std::min(shape.cycleLength, shape.functions - first);
+            unsigned callee = first + (f - first + 1) % length;
+            callees.push_back(functions[callee]);
+            called.set(callee);
+        }
+        unsigned window = std::min(shape.callWindow, shape.functions - f - 1);
+        for (unsigned c = 0; c < shape.fanOut && window; ++c) {
+            unsigned callee = f + 1 + (shape.callWindow == 1 ? c % window : random.below(window));
+            callees.push_back(functions[callee]);
+            called.set(callee);
+        }
+        buildBody(functions[f], global, shape, callees);
+    }
+
+    // main calls the roots of the call graph.
+    Function *main = Function::Create(type, GlobalValue::ExternalLinkage, "main", *module);
+    IRBuilder<> builder {BasicBlock::Create(context, "entry", main)};
+    for (unsigned f = 0; f < shape.functions; ++f)
+        if (!called.test(f))
+            builder.CreateCall(functions[f], {main->getArg(0)});
+    builder.CreateRet(builder.getInt32(0));
+    return module;
+}
@@ -0,0 +1,254 @@
+/*
+  prediction_bench - Time each phase of the prediction on synthetic modules.
+
+  Usage: prediction_bench [--shapes=a,b] [--sizes=n,m] [--repeat=N] [file...]
+
+  Each shape is built at each size with the builders of ir_builders.cc, and
+  the given .bc or .ll files, such as the ones of prediction_gen, are loaded.
+  The phases are then run in order over every function, as the pass runs them:
+
+    analyses         dominator, post-dominator and loop trees
+    buildInfo        BranchPredictionInfo::buildInfo alone
+    A1               BranchPredictionPass::run, buildInfo included
+    A2               BlockEdgeFrequencyPass::run
+    A3               FunctionCallFrequencyPass::run
+    costs            the cost loop, with --prediction-cost-kind
+
+  Each line gives the best time of the repetitions, then the heap kept by the
+  phase when it ends, and how much it raised the peak resident set size of
+  the process, both in KiB, measured on the first repetition. The peak only
+  grows, so a phase that stays under an earlier peak shows 0.
+*/
+
+#include "prediction_pass.cc"
+#include "ir_builders.cc"
+
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/SourceMgr.h>
+
+#include <sys/resource.h>
+
+#include <chrono>
+
+static cl::list<std::string> inputs_opt(
+    cl::Positional,
+    cl::ZeroOrMore,
+    cl::desc("<.bc or .ll files>"));
+
+static cl::list<std::string> shapes_opt(
+    "shapes",
+    cl::CommaSeparated,
+    cl::desc("Shapes to run: straight-line, loop-nest, switch, dense-calls, deep-calls, recursion "
+             "(default all, none when files are given)"),
+    cl::value_desc("shape,..."));
+
+static cl::list<unsigned> sizes_opt(
+    "sizes",
+    cl::CommaSeparated,
+    cl::desc("Sizes of each shape (default 1000,2000,4000)"),
+    cl::value_desc("n,..."));
+
+static cl::opt<unsigned> repeat_opt(
+    "repeat",
+    cl::init(3),
+    cl::desc("Runs of each phase, the best time is kept"),
+    cl::value_desc("N"));
+
+/// shapeOf - The shape of the given name and size, each shape growing along
+/// the dimension it stresses. Returns false for unknown names.
+static bool shapeOf(StringRef name, unsigned size, IRShape &shape) {
+    shape = IRShape();
+    if (name == "straight-line") {
+        shape.diamonds = size;
+    } else if (name == "loop-nest") {
+        shape.loopDepth = size;
+    } else if (name == "switch") {
+        shape.switchWidth = size;
+    } else if (name == "dense-calls") {
+        shape.functions = size;
+        shape.diamonds = 2;
+        shape.fanOut = 8;
+        shape.callWindow = size;
+    } else if (name == "deep-calls") {
+        shape.functions = size;
+        shape.fanOut = 1;
+    } else if (name == "recursion") {
+        shape.functions = size;
+        shape.loopDepth = 1;
+        shape.fanOut = 1;
+        shape.cycleLength = 8;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/// PhaseUsage - What a phase cost.
+struct PhaseUsage {
+    double seconds = numeric_limits<double>::infinity();
+    int64_t heap = 0;   // Heap kept at the end of the phase, in KiB.
+    int64_t maxRSS = 0; // Growth of the peak resident set size, in KiB.
+};
+
+static int64_t getMaxRSS() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss; // KiB on Linux.
+}
+
+/// PhaseTimer - Measure phases one after the other.
+class PhaseTimer {
+public:
+    PhaseTimer(vector<PhaseUsage> &usages, bool measureMemory) :
+        usages_(usages), measureMemory_(measureMemory) {}
+
+    /// time - Run the next phase.
+    template <typename Callable> void time(Callable phase) {
+        PhaseUsage &usage = usages_[next_++];
+        int64_t heap = sys::Process::GetMallocUsage();
+        int64_t maxRSS = getMaxRSS();
+        auto start = std::chrono::steady_clock::now();
+        phase();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        usage.seconds = std::min(usage.seconds, elapsed.count());
+        if (measureMemory_) {
+            usage.heap = (int64_t(sys::Process::GetMallocUsage()) - heap) / 1024;
+            usage.maxRSS = getMaxRSS() - maxRSS;
+        }
+    }
+
+private:
+    vector<PhaseUsage> &usages_;
+    bool measureMemory_;
+    size_t next_ = 0;
+};
+
+static const char *const phase_names[] = {"analyses", "buildInfo", "A1", "A2", "A3", "costs"};
+
+/// runPhases - Run every phase once over the module, with fresh analyses.
+static void runPhases(Module &module, ArrayRef<CostKind> kinds, PhaseTimer &timer) {
+    FunctionAnalysisManager fam;
+    PassBuilder pb;
+    pb.registerFunctionAnalyses(fam);
+
+    vector<Function *> functions {};
+    for (Function &func : module)
+        if (!func.isDeclaration())
+            functions.push_back(&func);
+
+    timer.time([&]() {
+        for (Function *func : functions) {
+            fam.getResult<DominatorTreeAnalysis>(*func);
+            fam.getResult<PostDominatorTreeAnalysis>(*func);
+            fam.getResult<LoopAnalysis>(*func);
+        }
+    });
+
+    timer.time([&]() {
+        for (Function *func : functions) {
+            BranchPredictionInfo info {&fam.getResult<DominatorTreeAnalysis>(*func),
+                                       &fam.getResult<LoopAnalysis>(*func),
+                                       &fam.getResult<PostDominatorTreeAnalysis>(*func)};
+            info.buildInfo(*func);
+        }
+    });
+
+    vector<BranchPredictionPass> predictions(functions.size());
+    timer.time([&]() {
+        for (size_t i = 0; i < functions.size(); ++i)
+            predictions[i].run(*functions[i], fam);
+    });
+
+    vector<unique_ptr<BlockEdgeFrequencyPass>> frequencies(functions.size());
+    DenseMap<Function *, BlockEdgeFrequencyPass *> function_block_edge_frequency_results {};
+    timer.time([&]() {
+        for (size_t i = 0; i < functions.size(); ++i) {
+            frequencies[i] = make_unique<BlockEdgeFrequencyPass>(&predictions[i]);
+            frequencies[i]->run(*functions[i], fam);
+            function_block_edge_frequency_results[functions[i]] = frequencies[i].get();
+        }
+    });
+
+    FunctionCallFrequencyPass call_frequencies {};
+    timer.time([&]() { call_frequencies.run(module, function_block_edge_frequency_results); });
+
+    // The cost loop of the pass, without the result cache and the writer.
+    double total_cost = 0;
+    timer.time([&]() {
+        InstructionCostCache cost_cache {kinds, cost_cache_opt};
+        vector<double> bcost(kinds.size());
+        for (size_t i = 0; i < functions.size(); ++i) {
+            TargetTransformInfo &tira = fam.getResult<TargetIRAnalysis>(*functions[i]);
+            for (BasicBlock &bb : *functions[i]) {
+                std::fill(bcost.begin(), bcost.end(), 0);
+                cost_cache.addBlockCosts(bb, tira, bcost);
+                double bfreq = call_frequencies.getGlobalBlockFrequency(*frequencies[i], &bb);
+                for (double cost : bcost)
+                    total_cost += cost * bfreq;
+            }
+        }
+    });
+    if (std::isnan(total_cost))
+        errs() << "WARNING! The total cost of " << module.getName() << " is not a number.\n";
+}
+
+/// benchmark - Run the phases over a module, and print one line per phase.
+static void benchmark(StringRef name, unsigned size, Module &module, ArrayRef<CostKind> kinds) {
+    size_t blocks = 0;
+    for (Function &func : module)
+        blocks += func.size();
+
+    vector<PhaseUsage> usages(array_lengthof(phase_names));
+    for (unsigned r = 0; r < std::max(1U, repeat_opt.getValue()); ++r) {
+        PhaseTimer timer {usages, r == 0};
+        runPhases(module, kinds, timer);
+    }
+    for (size_t p = 0; p < usages.size(); ++p)
+        outs() << name << "," << size << "," << module.size() << "," << blocks << "," << phase_names[p] << ","
+               << format("%.3f", usages[p].seconds * 1000) << "," << usages[p].heap << "," << usages[p].maxRSS
+               << "\n";
+    outs().flush();
+}
+
+int main(int argc, char **argv) {
+    InitLLVM init {argc, argv};
+    cl::ParseCommandLineOptions(argc, argv, "Wu-Larus static profile benchmark\n");
+
+    vector<std::string> shapes(shapes_opt.begin(), shapes_opt.end());
+    if (shapes.empty() && inputs_opt.empty())
+        shapes = {"straight-line", "loop-nest", "switch", "dense-calls", "deep-calls", "recursion"};
+    vector<unsigned> sizes(sizes_opt.begin(), sizes_opt.end());
+    if (sizes.empty())
+        sizes = {1000, 2000, 4000};
+    vector<CostKind> kinds = parseCostKinds();
+
+    outs() << "shape,size,functions,blocks,phase,ms,heap_kib,max_rss_kib\n";
+    for (const std::string &name : shapes) {
+        IRShape shape;
+        if (!shapeOf(name, 0, shape)) {
+            errs() << "WARNING! Invalid shape '" << name << "', skipping it.\n";
+            continue;
+        }
+        for (unsigned size : sizes) {
+            shapeOf(name, size, shape);
+            LLVMContext context;
+            std::unique_ptr<Module> module = buildModule(context, shape);
+            benchmark(name, size, *module, kinds);
+        }
+    }
+
+    // Files have no size of their own.
+    for (const std::string &path : inputs_opt) {
+        LLVMContext context;
+        SMDiagnostic diagnostic;
+        std::unique_ptr<Module> module = parseIRFile(path, diagnostic, context);
+        if (!module) {
+            diagnostic.print(argv[0], errs());
+            return 1;
+        }
+        benchmark(path, 0, *module, kinds);
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+  prediction_gen - Write a synthetic module, for stress and scaling runs.
+
+  Usage: prediction_gen [options] -o <file>
+
+  The module is built by ir_builders.cc, as in prediction_bench, and written
+  as bitcode, or as text with -S. The same options and seed always give the
+  same module, so generated inputs need not be kept around. For instance, a
+  module of the size of a large production one:
+
+    prediction_gen --functions=100000 --blocks=40 --loop-depth=2 \
+        --fan-out=6 --call-density=0.01 --recursion-cycle=4 -o big.bc
+*/
+
+#include "prediction_pass.cc"
+#include "ir_builders.cc"
+
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/InitLLVM.h>
+
+static cl::opt<unsigned> functions_opt(
+    "functions",
+    cl::init(1000),
+    cl::desc("Number of functions, besides main"),
+    cl::value_desc("N"));
+
+static cl::opt<unsigned> blocks_opt(
+    "blocks",
+    cl::init(8),
+    cl::desc("Approximate number of blocks per function, topped up with if-then diamonds"),
+    cl::value_desc("N"));
+
+static cl::opt<unsigned> loop_depth_opt(
+    "loop-depth",
+    cl::init(1),
+    cl::desc("Depth of the loop nest around the body of each function"),
+    cl::value_desc("N"));
+
+static cl::opt<unsigned> switch_width_opt(
+    "switch-width",
+    cl::init(0),
+    cl::desc("Cases of the switch of each function, 0 for none"),
+    cl::value_desc("N"));
+
+static cl::opt<unsigned> fan_out_opt(
+    "fan-out",
+    cl::init(2),
+    cl::desc("Call sites per function"),
+    cl::value_desc("N"));
+
+static cl::opt<double> call_density_opt(
+    "call-density",
+    cl::init(0.1),
+    cl::desc("Fraction of the following functions a function may call: 0 makes a chain, 1 a dense graph"),
+    cl::value_desc("fraction"));
+
+static cl::opt<unsigned> recursion_cycle_opt(
+    "recursion-cycle",
+    cl::init(0),
+    cl::desc("Group the functions into recursion cycles of this length, 0 for no recursion"),
+    cl::value_desc("N"));
+
+static cl::opt<uint64_t> seed_opt(
+    "seed",
+    cl::init(1),
+    cl::desc("Seed of the callee choices"));
+
+static cl::opt<std::string> output_file_opt(
+    "o",
+    cl::Required,
+    cl::desc("Output file, - for stdout"),
+    cl::value_desc("filename"));
+
+static cl::opt<bool> text_opt(
+    "S",
+    cl::init(false),
+    cl::desc("Write the module as text instead of bitcode"));
+
+int main(int argc, char **argv) {
+    InitLLVM init {argc, argv};
+    cl::ParseCommandLineOptions(argc, argv, "Synthetic modules for the Wu-Larus static profile\n");
+
+    IRShape shape;
+    shape.functions = functions_opt;
+    shape.loopDepth = loop_depth_opt;
+    shape.switchWidth = switch_width_opt;
+    shape.fanOut = fan_out_opt;
+    shape.cycleLength = recursion_cycle_opt;
+    shape.seed = seed_opt;
+
+    double density = std::min(1.0, std::max(0.0, call_density_opt.getValue()));
+    shape.callWindow = std::max(1U, unsigned(density * functions_opt));
+
+    // Entry, loop headers and exits, and the switch, then two blocks per diamond.
+    unsigned fixed = 1 + 2 * shape.loopDepth + (shape.switchWidth ? shape.switchWidth + 2 : 0);
+    shape.diamonds = blocks_opt > fixed ? (blocks_opt - fixed) / 2 : 0;
+
+    LLVMContext context;
+    std::unique_ptr<Module> module = buildModule(context, shape);
+    if (verifyModule(*module, &errs())) {
+        errs() << "ERROR! The generated module is broken.\n";
+        return 1;
+    }
+
+    std::error_code error;
+    raw_fd_ostream os {output_file_opt, error, text_opt ? sys::fs::OF_Text : sys::fs::OF_None};
+    if (error) {
+        errs() << "ERROR! Cannot open " << output_file_opt << ": " << error.message() << "\n";
+        return 1;
+    }
+    if (text_opt)
+        module->print(os, nullptr);
+    else
+        WriteBitcodeToFile(*module, os);
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ Memoized TargetTransformInfo::getInstructionCost.
+
+ Most instructions of a large module repeat a few shapes: the same opcode,
+ types and kinds of operands. The cost model only looks at those, so the costs
+ of an instruction are computed once per shape and target, and reused for every
+ instruction with the same shape.
+*/
+
+typedef std::pair<StringRef, TargetTransformInfo::TargetCostKind> CostKind;
+
+STATISTIC(NumCostCacheHits, "Number of instruction costs found in the cost cache");
+STATISTIC(NumCostCacheMisses, "Number of instruction costs computed by TargetTransformInfo");
+
+class InstructionCostCache {
+public:
+    InstructionCostCache(ArrayRef<CostKind> kinds, bool enabled) :
+        kinds_(kinds.begin(), kinds.end()), enabled_(enabled) {}
+
+    void addBlockCosts(const BasicBlock &bb, const TargetTransformInfo &tti, MutableArrayRef<double> costs);
+
+private:
+    std::vector<CostKind> kinds_;
+    bool enabled_;
+
+    // Shapes are arrays of words stored in the allocator. For each shape, the
+    // costs of all kinds are stored contiguously, NaN meaning an invalid cost.
+    BumpPtrAllocator allocator_;
+    DenseMap<ArrayRef<uintptr_t>, unsigned> shapes_;
+    std::vector<double> costs_;
+
+    bool getShape(const Instruction &instr, SmallVectorImpl<uintptr_t> &shape) const;
+    void computeCosts(const Instruction &instr, const TargetTransformInfo &tti, double *costs) const;
+};
+
+/// getFastMathBits - The fast-math flags as bits, one per flag.
+static unsigned getFastMathBits(FastMathFlags fmf) {
+    return fmf.allowReassoc() | fmf.noNaNs() << 1 | fmf.noInfs() << 2 | fmf.noSignedZeros() << 3 |
+        fmf.allowReciprocal() << 4 | fmf.allowContract() << 5 | fmf.approxFunc() << 6;
+}
+
+/// getShape - Describe everything the cost model may look at to price an
+/// instruction: its opcode, type and fast-math flags, the types and kinds of
+/// its operands, and its single user. Constants are uniqued, so they are
+/// described by their address. The cost of a branch does not depend on its
+/// targets, so blocks are only tagged as such. Returns false for instructions
+/// whose cost depends on data that is not an operand, which are not cached.
+bool InstructionCostCache::getShape(const Instruction &instr, SmallVectorImpl<uintptr_t> &shape) const {
+    if (isa<ShuffleVectorInst>(instr) || isa<ExtractValueInst>(instr) || isa<InsertValueInst>(instr))
+        return false;
+
+    shape.push_back(instr.getOpcode());
+    shape.push_back(reinterpret_cast<uintptr_t>(instr.getType()));
+    if (isa<FPMathOperator>(instr))
+        shape.push_back(getFastMathBits(instr.getFastMathFlags()));
+
+    // Opcode specific data.
+    if (auto *cmp = dyn_cast<CmpInst>(&instr)) {
+        shape.push_back(cmp->getPredicate());
+    } else if (auto *load = dyn_cast<LoadInst>(&instr)) {
+        shape.push_back(load->getAlign().value());
+        shape.push_back(load->isVolatile());
+    } else if (auto *store = dyn_cast<StoreInst>(&instr)) {
+        shape.push_back(store->getAlign().value());
+        shape.push_back(store->isVolatile());
+    } else if (auto *gep = dyn_cast<GetElementPtrInst>(&instr)) {
+        shape.push_back(reinterpret_cast<uintptr_t>(gep->getSourceElementType()));
+        shape.push_back(gep->isInBounds());
+    } else if (auto *alloca = dyn_cast<AllocaInst>(&instr)) {
+        shape.push_back(reinterpret_cast<uintptr_t>(alloca->getAllocatedType()));
+        shape.push_back(alloca->getAlign().value());
+    } else if (auto *call = dyn_cast<CallBase>(&instr)) {
+        shape.push_back(reinterpret_cast<uintptr_t>(call->getFunctionType()));
+    }
+
+    // Operands.
+    shape.push_back(instr.getNumOperands());
+    for (const Value *operand : instr.operands()) {
+        shape.push_back(reinterpret_cast<uintptr_t>(operand->getType()));
+        if (isa<Constant>(operand)) {
+            shape.push_back(reinterpret_cast<uintptr_t>(operand));
+        } else if (isa<BasicBlock>(operand)) {
+            shape.push_back(3);
+        } else if (auto *def = dyn_cast<Instruction>(operand)) {
+            shape.push_back(1);
+            shape.push_back(def->getOpcode());
+            shape.push_back(isa<CmpInst>(def) ? cast<CmpInst>(def)->getPredicate() : 0);
+            shape.push_back(def->hasOneUse());
+        } else {
+            shape.push_back(2);
+        }
+    }
+
+    // Single user.
+    shape.push_back(instr.hasOneUse() ? cast<Instruction>(*instr.user_begin())->getOpcode() : 0);
+    return true;
+}
+
+/// computeCosts - Ask the target for the costs of an instruction.
+void InstructionCostCache::computeCosts(const Instruction &instr, const TargetTransformInfo &tti,
+                                        double *costs) const {
+    for (size_t k = 0; k < kinds_.size(); ++k) {
+        InstructionCost cost = tti.getInstructionCost(&instr, kinds_[k].second);
+        costs[k] = cost.getValue().hasValue() ? cost.getValue().getValue() :
+            std::numeric_limits<double>::quiet_NaN();
+    }
+    ++NumCostCacheMisses;
+}
+
+/// addBlockCosts - Add the costs of every instruction of a basic block to
+/// costs, one entry per cost kind.
+void InstructionCostCache::addBlockCosts(const BasicBlock &bb, const TargetTransformInfo &tti,
+                                         MutableArrayRef<double> costs) {
+    SmallVector<uintptr_t, 32> shape;
+    SmallVector<double, 4> uncached(kinds_.size());
+    for (const Instruction &instr : bb) {
+        const double *icosts;
+        shape.clear();
+        if (!enabled_ || !getShape(instr, shape)) {
+            computeCosts(instr, tti, uncached.data());
+            icosts = uncached.data();
+        } else {
+            auto found = shapes_.find(ArrayRef<uintptr_t>(shape));
+            if (found != shapes_.end()) {
+                ++NumCostCacheHits;
+            } else {
+                uintptr_t *words = allocator_.Allocate<uintptr_t>(shape.size());
+                std::copy(shape.begin(), shape.end(), words);
+                found = shapes_.insert(std::make_pair(ArrayRef<uintptr_t>(words, shape.size()),
+                                                      (unsigned) costs_.size())).first;
+                costs_.resize(costs_.size() + kinds_.size());
+                computeCosts(instr, tti, &costs_[found->second]);
+            }
+            icosts = &costs_[found->second];
+        }
+
+        for (size_t k = 0; k < kinds_.size(); ++k)
+            if (!std::isnan(icosts[k]))
+                costs[k] += icosts[k];
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ Storage of what a run of the pass keeps for a whole module.
+
+ The objects and arrays are carved one after the other out of large slabs,
+ instead of one heap allocation each, and released in one shot along with the
+ arena at the end of the run. The results of algorithms 1 and 2 computed by
+ the analysis managers are owned by them, and only stored here when they are
+ restored from the cache directory.
+*/
+
+/// PredictionArena - Bump pointer storage of one run of the pass.
+class PredictionArena {
+public:
+    PredictionArena() = default;
+    PredictionArena(const PredictionArena &) = delete;
+    PredictionArena &operator=(const PredictionArena &) = delete;
+
+    /// ~PredictionArena - Destroy the objects, last created first, then free the slabs.
+    ~PredictionArena() {
+        for (auto I = destructors_.rbegin(), E = destructors_.rend(); I != E; ++I)
+            I->second(I->first);
+    }
+
+    /// allocate - An array of n zeroed elements, which are never destroyed.
+    template <typename T> MutableArrayRef<T> allocate(size_t n) {
+        static_assert(std::is_trivially_destructible<T>::value, "Arrays of the arena are never destroyed");
+        T *data = allocator_.Allocate<T>(n);
+        std::uninitialized_fill_n(data, n, T());
+        return MutableArrayRef<T>(data, n);
+    }
+
+    /// create - An object, destroyed along with the arena.
+    template <typename T, typename... Args> T *create(Args &&...args) {
+        T *object = new (allocator_.Allocate<T>()) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+            destructors_.emplace_back(object, [](void *p) { static_cast<T *>(p)->~T(); });
+        return object;
+    }
+
+    /// getBytesUsed - Bytes handed out so far.
+    size_t getBytesUsed() const { return allocator_.getBytesAllocated(); }
+    /// getBytesReserved - Bytes of the slabs, padding and unused tails included.
+    size_t getBytesReserved() const { return allocator_.getTotalMemory(); }
+
+private:
+    BumpPtrAllocator allocator_;
+    std::vector<std::pair<void *, void (*)(void *)>> destructors_;
+};
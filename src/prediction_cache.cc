@@ -0,0 +1,273 @@
+/*
+ On-disk cache of per-function results.
+
+ The results of algorithms 1 and 2 and the block costs of a function only depend
+ on its body, its target and the options of the run, so they are stored in a
+ directory under a hash of those, and reused by later runs over the same, or a
+ re-linked, module. Algorithm 3 always runs over the whole call graph.
+
+ Each entry is a file with a little endian header, followed by arrays of doubles:
+
+   "WLPC", version, blocks, edges, kinds  (uint32 each)
+   edge probabilities                     [edges]
+   local block frequencies                [blocks]
+   local edge frequencies                 [edges]
+   block costs                            [blocks * kinds], NaN-free sums
+
+ Entries are written to a unique temporary file and renamed into place, so
+ concurrent processes sharing the directory never read a partial entry.
+*/
+
+STATISTIC(NumPredictionCacheHits, "Number of functions whose results were found in the cache directory");
+STATISTIC(NumPredictionCacheMisses, "Number of functions analysed and stored in the cache directory");
+
+class PredictionCache {
+public:
+    /// Entry - The cached results of a function. Edges and blocks are indexed
+    /// as in BranchPredictionPass and CFGSnapshot.
+    struct Entry {
+        std::vector<double> edgeProbabilities;
+        std::vector<double> blockFrequencies;
+        std::vector<double> edgeFrequencies;
+        std::vector<double> blockCosts; // Block b, kind k at b * kinds + k.
+    };
+
+    PredictionCache(StringRef dir, ArrayRef<CostKind> kinds, StringRef options);
+
+    bool isEnabled() const { return !dir_.empty(); }
+    std::string getKey(const Function &func) const;
+    bool lookup(StringRef key, const Function &func, Entry &entry) const;
+    void store(StringRef key, const Entry &entry) const;
+
+private:
+    static const uint32_t version_;
+
+    std::string dir_;
+    unsigned numKinds_;
+    std::string options_; // Cost kinds and options, part of every key.
+
+    std::string getPath(StringRef key) const { return dir_ + "/" + key.str() + ".wlpc"; }
+};
+
+// Bump when a change to the algorithms changes their results.
+const uint32_t PredictionCache::version_ = 1;
+
+PredictionCache::PredictionCache(StringRef dir, ArrayRef<CostKind> kinds, StringRef options) :
+    dir_(dir.str()), numKinds_(kinds.size()) {
+    raw_string_ostream os(options_);
+    os << version_ << ";" << options;
+    for (const CostKind &kind : kinds)
+        os << ";" << kind.first;
+    os.flush();
+
+    if (!dir_.empty()) {
+        if (std::error_code error = sys::fs::create_directories(dir_)) {
+            errs() << "WARNING! Cannot create the cache directory " << dir_ << ": " << error.message()
+                   << ", not caching.\n";
+            dir_.clear();
+        }
+    }
+}
+
+/// getKey - Hash everything the results of a function depend on: its
+/// instructions with their flags and attributes, types, constants, callees and
+/// control flow, its target, and the options of the run. Values are described
+/// by their position in the function, and globals by their names, so that the
+/// key of a function does not change when the module around it does.
+std::string PredictionCache::getKey(const Function &func) const {
+    MD5 hash;
+    auto addWord = [&](uint64_t word) {
+        uint8_t bytes[8];
+        support::endian::write64le(bytes, word);
+        hash.update(ArrayRef<uint8_t>(bytes, sizeof(bytes)));
+    };
+    auto addString = [&](StringRef string) {
+        addWord(string.size());
+        hash.update(string);
+    };
+
+    // Types are hashed by their textual form, printed once per type.
+    DenseMap<const Type *, std::string> typeNames;
+    auto addType = [&](Type *type) {
+        auto found = typeNames.insert(std::make_pair(type, std::string()));
+        if (found.second) {
+            raw_string_ostream os(found.first->second);
+            type->print(os);
+        }
+        addString(found.first->second);
+    };
+
+    const Module *module = func.getParent();
+    addString(options_);
+    addString(module->getTargetTriple());
+    addString(module->getDataLayoutStr());
+    addString(func.getFnAttribute("target-cpu").getValueAsString());
+    addString(func.getFnAttribute("target-features").getValueAsString());
+    addType(func.getFunctionType());
+
+    // Number the arguments, blocks and instructions first, so that operands
+    // defined further down can be referred to.
+    DenseMap<const Value *, unsigned> numbers;
+    unsigned number = 0;
+    for (const Argument &arg : func.args())
+        numbers[&arg] = number++;
+    for (const BasicBlock &bb : func) {
+        numbers[&bb] = number++;
+        for (const Instruction &instr : bb)
+            numbers[&instr] = number++;
+    }
+
+    for (const BasicBlock &bb : func) {
+        addWord(bb.size());
+        for (const Instruction &instr : bb) {
+            addWord(instr.getOpcode());
+            addType(instr.getType());
+
+            // Flags, which the cost model may look at.
+            if (auto *op = dyn_cast<OverflowingBinaryOperator>(&instr))
+                addWord(op->hasNoUnsignedWrap() | op->hasNoSignedWrap() << 1);
+            if (auto *op = dyn_cast<PossiblyExactOperator>(&instr))
+                addWord(op->isExact());
+            if (isa<FPMathOperator>(instr))
+                addWord(getFastMathBits(instr.getFastMathFlags()));
+
+            // Opcode specific data.
+            if (auto *cmp = dyn_cast<CmpInst>(&instr)) {
+                addWord(cmp->getPredicate());
+            } else if (auto *load = dyn_cast<LoadInst>(&instr)) {
+                addWord(load->getAlign().value());
+                addWord(load->isVolatile());
+            } else if (auto *store = dyn_cast<StoreInst>(&instr)) {
+                addWord(store->getAlign().value());
+                addWord(store->isVolatile());
+            } else if (auto *gep = dyn_cast<GetElementPtrInst>(&instr)) {
+                addType(gep->getSourceElementType());
+                addWord(gep->isInBounds());
+            } else if (auto *alloca = dyn_cast<AllocaInst>(&instr)) {
+                addType(alloca->getAllocatedType());
+                addWord(alloca->getAlign().value());
+            } else if (auto *call = dyn_cast<CallBase>(&instr)) {
+                addType(call->getFunctionType());
+                AttributeList attrs = call->getAttributes();
+                for (unsigned index : attrs.indexes()) {
+                    addWord(index);
+                    addString(attrs.getAsString(index));
+                }
+            } else if (auto *shuffle = dyn_cast<ShuffleVectorInst>(&instr)) {
+                for (int element : shuffle->getShuffleMask())
+                    addWord(element);
+            } else if (auto *extract = dyn_cast<ExtractValueInst>(&instr)) {
+                for (unsigned index : extract->indices())
+                    addWord(index);
+            } else if (auto *insert = dyn_cast<InsertValueInst>(&instr)) {
+                for (unsigned index : insert->indices())
+                    addWord(index);
+            } else if (auto *phi = dyn_cast<PHINode>(&instr)) {
+                for (const BasicBlock *incoming : phi->blocks())
+                    addWord(numbers.lookup(incoming));
+            }
+
+            // Operands.
+            addWord(instr.getNumOperands());
+            for (const Value *operand : instr.operands()) {
+                auto found = numbers.find(operand);
+                if (found != numbers.end()) {
+                    addWord(0);
+                    addWord(found->second);
+                } else if (auto *global = dyn_cast<GlobalValue>(operand)) {
+                    addWord(1);
+                    addString(global->getName());
+                } else if (isa<MetadataAsValue>(operand)) {
+                    // Debug info must not change the key.
+                    addWord(3);
+                } else {
+                    // Constants and inline asm, by their textual form.
+                    std::string text;
+                    raw_string_ostream os(text);
+                    operand->printAsOperand(os, true);
+                    addWord(2);
+                    addString(os.str());
+                }
+            }
+        }
+    }
+
+    MD5::MD5Result result;
+    hash.final(result);
+    return result.digest().str().str();
+}
+
+/// lookup - Read the entry of a function. Returns false if there is none, or
+/// if it does not match the shape of the function.
+bool PredictionCache::lookup(StringRef key, const Function &func, Entry &entry) const {
+    if (!isEnabled())
+        return false;
+
+    auto buffer = MemoryBuffer::getFile(getPath(key), /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer)
+        return false;
+    StringRef data = (*buffer)->getBuffer();
+
+    const unsigned headerSize = 5 * sizeof(uint32_t);
+    if (data.size() < headerSize || !data.startswith("WLPC"))
+        return false;
+    const char *p = data.data() + sizeof(uint32_t);
+    auto readWord = [&]() {
+        uint32_t word = support::endian::read32le(p);
+        p += sizeof(uint32_t);
+        return word;
+    };
+    uint32_t version = readWord(), blocks = readWord(), edges = readWord(), kinds = readWord();
+
+    unsigned funcEdges = 0;
+    for (const BasicBlock &bb : func)
+        funcEdges += bb.getTerminator()->getNumSuccessors();
+    if (version != version_ || blocks != func.size() || edges != funcEdges || kinds != numKinds_ ||
+        data.size() != headerSize + sizeof(double) * (2 * (uint64_t) edges + blocks + (uint64_t) blocks * kinds))
+        return false;
+
+    auto readArray = [&](std::vector<double> &array, size_t size) {
+        array.resize(size);
+        for (double &value : array) {
+            value = BitsToDouble(support::endian::read64le(p));
+            p += sizeof(double);
+        }
+    };
+    readArray(entry.edgeProbabilities, edges);
+    readArray(entry.blockFrequencies, blocks);
+    readArray(entry.edgeFrequencies, edges);
+    readArray(entry.blockCosts, (size_t) blocks * kinds);
+    return true;
+}
+
+/// store - Write the entry of a function. Failures only cost a later miss.
+void PredictionCache::store(StringRef key, const Entry &entry) const {
+    if (!isEnabled())
+        return;
+
+    SmallString<128> temp;
+    int fd;
+    if (sys::fs::createUniqueFile(dir_ + "/%%%%%%%%%%%%%%%%.tmp", fd, temp))
+        return;
+    {
+        raw_fd_ostream os(fd, /*shouldClose=*/true);
+        support::endian::Writer writer(os, support::little);
+        os << "WLPC";
+        writer.write<uint32_t>(version_);
+        writer.write<uint32_t>(entry.blockFrequencies.size());
+        writer.write<uint32_t>(entry.edgeFrequencies.size());
+        writer.write<uint32_t>(numKinds_);
+        writer.write(ArrayRef<double>(entry.edgeProbabilities));
+        writer.write(ArrayRef<double>(entry.blockFrequencies));
+        writer.write(ArrayRef<double>(entry.edgeFrequencies));
+        writer.write(ArrayRef<double>(entry.blockCosts));
+        os.close();
+        if (os.has_error()) {
+            os.clear_error();
+            sys::fs::remove(temp);
+            return;
+        }
+    }
+    if (sys::fs::rename(temp, getPath(key)))
+        sys::fs::remove(temp);
+}
@@ -0,0 +1,174 @@
+/*
+  Binary result file of the prediction pass, written with
+  --prediction-output-format=binary.
+
+  The file is meant to be mapped in memory and indexed in place, with no
+  parsing. It is little endian, and every section starts at a multiple of 8
+  bytes from the start of the file:
+
+    Header
+    String   kinds             [numKinds]         cost kind names
+    Function functions         [numFunctions]     in module order
+    double   functionCosts     [numFunctions * numKinds]
+    double   blockFrequencies  [numBlocks]        global frequencies
+    double   blockCosts        [numBlocks * numKinds]
+                                                  cost of one execution
+    uint32   blockEdges        [numBlocks + 1]    first edge of each block
+    uint32   edgeTargets       [numEdges]         successor, as a block index
+                                                  within the function
+    double   edgeProbabilities [numEdges]
+    double   edgeFrequencies   [numEdges]         global frequencies
+    uint32   callCallees       [numCalls]         called function index
+    double   callFrequencies   [numCalls]         gfreq of each call edge
+    char     strings           [stringsSize]      null terminated strings
+
+  The blocks of function f are [firstBlock, firstBlock + numBlocks), in
+  layout order, and the successors of block b are the edges
+  [blockEdges[b], blockEdges[b + 1]), in successor order. The calls of
+  function f, one per distinct callee, are [firstCall, firstCall + numCalls).
+
+  This header only depends on the standard library, so that consumers can
+  copy it.
+*/
+
+#ifndef PREDICTION_FORMAT_H
+#define PREDICTION_FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace prediction_format {
+
+static const char Magic[8] = {'W', 'L', 'P', 'R', 'E', 'D', '\r', '\n'};
+static const uint32_t Version = 1;
+static const uint64_t Alignment = 8;
+
+/// String - A string of the string table. It is followed by a null
+/// character, not counted in its size.
+struct String {
+    uint32_t offset;
+    uint32_t size;
+};
+
+/// Header - Counts, and offsets of the sections from the start of the file.
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t numKinds;
+    uint64_t numFunctions;
+    uint64_t numBlocks;
+    uint64_t numEdges;
+    uint64_t numCalls;
+    uint64_t fileSize;
+
+    uint64_t kinds;
+    uint64_t functions;
+    uint64_t functionCosts;
+    uint64_t blockFrequencies;
+    uint64_t blockCosts;
+    uint64_t blockEdges;
+    uint64_t edgeTargets;
+    uint64_t edgeProbabilities;
+    uint64_t edgeFrequencies;
+    uint64_t callCallees;
+    uint64_t callFrequencies;
+    uint64_t strings;
+    uint64_t stringsSize;
+};
+
+enum FunctionFlags : uint32_t {
+    FunctionDeclaration = 1 // No body, and thus no blocks.
+};
+
+/// Function - A function of the module.
+struct Function {
+    String name;
+    uint32_t firstBlock;
+    uint32_t numBlocks;
+    uint32_t firstCall;
+    uint32_t numCalls;
+    double callFrequency; // cfreq, 0 for functions never called.
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(String) == 8, "Unexpected padding");
+static_assert(sizeof(Header) == 160, "Unexpected padding");
+static_assert(sizeof(Function) == 40, "Unexpected padding");
+
+/// Reader - Typed view of a file mapped in memory. The sections are checked
+/// to lie within the file when it is opened, their contents are not.
+class Reader {
+public:
+    /// open - Use the size bytes at data, which must be 8 byte aligned.
+    /// Returns false if they are not a file of this version.
+    bool open(const void *data, size_t size) {
+        data_ = nullptr;
+        const uint16_t one = 1;
+        if (*reinterpret_cast<const char *>(&one) != 1) return false; // Big endian host.
+        if (reinterpret_cast<uintptr_t>(data) % Alignment || size < sizeof(Header)) return false;
+
+        const Header &h = *static_cast<const Header *>(data);
+        if (std::memcmp(h.magic, Magic, sizeof(Magic)) || h.version != Version || h.fileSize > size)
+            return false;
+        if (!fits(h, h.kinds, h.numKinds, sizeof(String)) ||
+            !fits(h, h.functions, h.numFunctions, sizeof(Function)) ||
+            !fits(h, h.functionCosts, h.numFunctions * h.numKinds, sizeof(double)) ||
+            !fits(h, h.blockFrequencies, h.numBlocks, sizeof(double)) ||
+            !fits(h, h.blockCosts, h.numBlocks * h.numKinds, sizeof(double)) ||
+            !fits(h, h.blockEdges, h.numBlocks + 1, sizeof(uint32_t)) ||
+            !fits(h, h.edgeTargets, h.numEdges, sizeof(uint32_t)) ||
+            !fits(h, h.edgeProbabilities, h.numEdges, sizeof(double)) ||
+            !fits(h, h.edgeFrequencies, h.numEdges, sizeof(double)) ||
+            !fits(h, h.callCallees, h.numCalls, sizeof(uint32_t)) ||
+            !fits(h, h.callFrequencies, h.numCalls, sizeof(double)) ||
+            !fits(h, h.strings, h.stringsSize, 1))
+            return false;
+
+        data_ = static_cast<const char *>(data);
+        return true;
+    }
+
+    const Header &header() const { return *reinterpret_cast<const Header *>(data_); }
+    uint32_t numKinds() const { return header().numKinds; }
+    uint64_t numFunctions() const { return header().numFunctions; }
+    uint64_t numBlocks() const { return header().numBlocks; }
+    uint64_t numEdges() const { return header().numEdges; }
+    uint64_t numCalls() const { return header().numCalls; }
+
+    const char *str(const String &s) const { return data_ + header().strings + s.offset; }
+    const String &kind(uint32_t k) const { return section<String>(header().kinds)[k]; }
+
+    const Function &function(uint64_t f) const { return section<Function>(header().functions)[f]; }
+    const double *functionCosts(uint64_t f) const {
+        return section<double>(header().functionCosts) + f * numKinds();
+    }
+
+    double blockFrequency(uint64_t b) const { return section<double>(header().blockFrequencies)[b]; }
+    const double *blockCosts(uint64_t b) const { return section<double>(header().blockCosts) + b * numKinds(); }
+    uint32_t edgesBegin(uint64_t b) const { return section<uint32_t>(header().blockEdges)[b]; }
+    uint32_t edgesEnd(uint64_t b) const { return section<uint32_t>(header().blockEdges)[b + 1]; }
+
+    uint32_t edgeTarget(uint64_t e) const { return section<uint32_t>(header().edgeTargets)[e]; }
+    double edgeProbability(uint64_t e) const { return section<double>(header().edgeProbabilities)[e]; }
+    double edgeFrequency(uint64_t e) const { return section<double>(header().edgeFrequencies)[e]; }
+
+    uint32_t callee(uint64_t c) const { return section<uint32_t>(header().callCallees)[c]; }
+    double callFrequency(uint64_t c) const { return section<double>(header().callFrequencies)[c]; }
+
+private:
+    const char *data_ = nullptr;
+
+    template <typename T> const T *section(uint64_t offset) const {
+        return reinterpret_cast<const T *>(data_ + offset);
+    }
+
+    static bool fits(const Header &h, uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % Alignment == 0 && offset <= h.fileSize && count <= (h.fileSize - offset) / size;
+    }
+};
+
+} // namespace prediction_format
+
+#endif // PREDICTION_FORMAT_H
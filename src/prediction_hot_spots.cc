@@ -0,0 +1,182 @@
+/*
+ Report of the hot spots of a module: its blocks, loops and functions of
+ highest cost, for each cost kind.
+
+ Costs are global. The cost of a block is its cost of one execution times its
+ global frequency; a loop costs the sum of its blocks, nested loops included,
+ and a function the sum of all its blocks, as in the text report. Only the top
+ N spots of each sort are kept, in heaps whose top is the cheapest of them, so
+ that the report takes O(n log N) time and O(N) memory on a module of n
+ blocks. Each spot is printed with its share of the total cost of the kind,
+ and with its source location when the module has debug info.
+*/
+
+/// sumLoopCosts - Find the loops of a function, outermost first, and their
+/// global costs, loop l and kind k at l * kinds + k. blockCosts holds the
+/// costs of one execution of block b at b * kinds, and scale turns the local
+/// frequencies of the function into global ones.
+static void sumLoopCosts(const BlockEdgeFrequencyPass &local, const LoopInfo &loopInfo, double scale,
+                         ArrayRef<double> blockCosts, size_t kinds, SmallVectorImpl<Loop *> &loops,
+                         std::vector<double> &loopCosts) {
+    loops = loopInfo.getLoopsInPreorder();
+    SmallDenseMap<const Loop *, unsigned, 8> loopIds {};
+    for (unsigned l = 0; l < loops.size(); ++l)
+        loopIds[loops[l]] = l;
+    loopCosts.assign(loops.size() * kinds, 0);
+    if (loops.empty())
+        return;
+
+    const CFGSnapshot &cfg = local.getCFG();
+    for (unsigned b = 0; b < cfg.getNumBlocks(); ++b) {
+        double bfreq = local.getBlockFrequency(b) * scale;
+        for (const Loop *L = loopInfo.getLoopFor(cfg.getBlock(b)); L; L = L->getParentLoop())
+            for (size_t k = 0; k < kinds; ++k)
+                loopCosts[loopIds[L] * kinds + k] += blockCosts[b * kinds + k] * bfreq;
+    }
+}
+
+/// printBlockName - Print a block as function:block, unnamed blocks by their
+/// index in layout order.
+static void printBlockName(raw_ostream &os, const BasicBlock &BB, unsigned index) {
+    os << BB.getParent()->getName() << ":";
+    if (BB.hasName())
+        os << BB.getName();
+    else
+        os << "#" << index;
+}
+
+/// printLocation - Print the file:line of the first instruction of a block
+/// having one, after two spaces, or nothing without debug info.
+static void printLocation(raw_ostream &os, const BasicBlock &BB) {
+    for (const Instruction &I : BB) {
+        if (const DILocation *DL = I.getDebugLoc().get()) {
+            if (DL->getLine()) {
+                os << "  " << DL->getFilename() << ":" << DL->getLine();
+                return;
+            }
+        }
+    }
+}
+
+/// printLocation - Print the file:line of the subprogram of a function.
+static void printLocation(raw_ostream &os, const Function &func) {
+    if (const DISubprogram *SP = func.getSubprogram())
+        os << "  " << SP->getFilename() << ":" << SP->getLine();
+}
+
+class HotSpotReport {
+public:
+    HotSpotReport(unsigned size, const FunctionCallFrequencyPass &global, ArrayRef<CostKind> kinds);
+
+    bool isEnabled() const { return size_ > 0; }
+    void addFunction(const Function &func, const BlockEdgeFrequencyPass &local, const LoopInfo &loopInfo,
+                     ArrayRef<double> blockCosts, ArrayRef<double> cost);
+    void print(raw_ostream &os, ArrayRef<double> totalCost) const;
+
+private:
+    enum SpotSort { FUNCTION_SPOT, LOOP_SPOT, BLOCK_SPOT, NUM_SPOT_SORTS };
+
+    // A block, a loop given by its header, or a function, with its cost.
+    struct Spot {
+        double cost;
+        unsigned order; // Spots of the same cost are listed in the order they were found.
+        const Function *func;
+        const BasicBlock *block; // Null for functions.
+        unsigned index;          // Of the block in layout order.
+        unsigned depth;          // Of the loop.
+
+        /// hotter - Whether a comes before b in the report.
+        static bool hotter(const Spot &a, const Spot &b) {
+            return a.cost > b.cost || (a.cost == b.cost && a.order < b.order);
+        }
+    };
+
+    unsigned size_;
+    const FunctionCallFrequencyPass &global_;
+    std::vector<CostKind> kinds_;
+    std::vector<std::vector<Spot>> heaps_; // Of kind k and sort s at k * NUM_SPOT_SORTS + s.
+    unsigned numSpots_ = 0;
+
+    // The loops of the function being added, and their costs.
+    SmallVector<Loop *, 8> loops_;
+    std::vector<double> loopCosts_;
+
+    void addSpot(SpotSort sort, size_t kind, Spot spot);
+};
+
+HotSpotReport::HotSpotReport(unsigned size, const FunctionCallFrequencyPass &global, ArrayRef<CostKind> kinds) :
+    size_(size), global_(global), kinds_(kinds.begin(), kinds.end()), heaps_(kinds.size() * NUM_SPOT_SORTS) {
+    for (std::vector<Spot> &heap : heaps_)
+        heap.reserve(size_);
+}
+
+/// addFunction - Rank the blocks and loops of a function, and the function
+/// itself. blockCosts holds the costs of one execution of block b at
+/// b * kinds, and cost the cost of the whole function.
+void HotSpotReport::addFunction(const Function &func, const BlockEdgeFrequencyPass &local,
+                                const LoopInfo &loopInfo, ArrayRef<double> blockCosts, ArrayRef<double> cost) {
+    if (!isEnabled())
+        return;
+
+    const CFGSnapshot &cfg = local.getCFG();
+    double scale = global_.getFrequencyScale(&func);
+    for (unsigned b = 0; b < cfg.getNumBlocks(); ++b) {
+        double bfreq = local.getBlockFrequency(b) * scale;
+        for (size_t k = 0; k < kinds_.size(); ++k)
+            addSpot(BLOCK_SPOT, k, {blockCosts[b * kinds_.size() + k] * bfreq, 0, &func, cfg.getBlock(b), b, 0});
+    }
+
+    sumLoopCosts(local, loopInfo, scale, blockCosts, kinds_.size(), loops_, loopCosts_);
+    for (unsigned l = 0; l < loops_.size(); ++l) {
+        const BasicBlock *header = loops_[l]->getHeader();
+        for (size_t k = 0; k < kinds_.size(); ++k)
+            addSpot(LOOP_SPOT, k, {loopCosts_[l * kinds_.size() + k], 0, &func, header, cfg.getBlockId(header),
+                                   loops_[l]->getLoopDepth()});
+    }
+
+    for (size_t k = 0; k < kinds_.size(); ++k)
+        addSpot(FUNCTION_SPOT, k, {cost[k], 0, &func, nullptr, 0, 0});
+}
+
+/// addSpot - Keep the spot if it is among the size_ hottest of its sort.
+void HotSpotReport::addSpot(SpotSort sort, size_t kind, Spot spot) {
+    std::vector<Spot> &heap = heaps_[kind * NUM_SPOT_SORTS + sort];
+    spot.order = numSpots_++;
+    if (heap.size() < size_) {
+        heap.push_back(spot);
+        std::push_heap(heap.begin(), heap.end(), Spot::hotter);
+    } else if (Spot::hotter(spot, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), Spot::hotter);
+        heap.back() = spot;
+        std::push_heap(heap.begin(), heap.end(), Spot::hotter);
+    }
+}
+
+/// print - Print the spots of each cost kind, hottest first.
+void HotSpotReport::print(raw_ostream &os, ArrayRef<double> totalCost) const {
+    static const char *const sort_names[] = {"functions", "loops", "blocks"};
+
+    for (size_t k = 0; k < kinds_.size() && isEnabled(); ++k) {
+        os << "Hot spots (" << kinds_[k].first << "), top " << size_ << " of total cost " << totalCost[k] << ":\n";
+        for (unsigned s = 0; s < NUM_SPOT_SORTS; ++s) {
+            std::vector<Spot> spots = heaps_[k * NUM_SPOT_SORTS + s];
+            std::sort(spots.begin(), spots.end(), Spot::hotter);
+            os << "  Hot " << sort_names[s] << ":\n";
+            for (const Spot &spot : spots) {
+                double share = totalCost[k] ? spot.cost / totalCost[k] : 0.0;
+                os << format("    %5.1f%%  %e  ", share * 100, spot.cost);
+                if (spot.block)
+                    printBlockName(os, *spot.block, spot.index);
+                else
+                    os << spot.func->getName();
+                if (s == LOOP_SPOT)
+                    os << " (depth " << spot.depth << ")";
+                if (spot.block)
+                    printLocation(os, *spot.block);
+                else
+                    printLocation(os, *spot.func);
+                os << "\n";
+            }
+        }
+    }
+}
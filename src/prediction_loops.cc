@@ -0,0 +1,78 @@
+/*
+ Report of the loops of a module, in module order and outermost first within
+ a function. Each loop is given by its header, with its nesting depth, the
+ global frequency of its header, the average number of iterations each time
+ it is entered, from algorithm 2, and its inclusive cost: the global cost of
+ its blocks, nested loops included, for each cost kind, with its share of the
+ total cost.
+*/
+
+class LoopReport {
+public:
+    LoopReport(bool enabled, const FunctionCallFrequencyPass &global, ArrayRef<CostKind> kinds) :
+        enabled_(enabled), global_(global), kinds_(kinds.begin(), kinds.end()) {}
+
+    bool isEnabled() const { return enabled_; }
+    void addFunction(const Function &func, const BlockEdgeFrequencyPass &local, const LoopInfo &loopInfo,
+                     ArrayRef<double> blockCosts);
+    void print(raw_ostream &os, ArrayRef<double> totalCost) const;
+
+private:
+    struct LoopEntry {
+        const BasicBlock *header;
+        unsigned index; // Of the header in layout order.
+        unsigned depth;
+        double frequency;
+        double iterations;
+    };
+
+    bool enabled_;
+    const FunctionCallFrequencyPass &global_;
+    std::vector<CostKind> kinds_;
+    std::vector<LoopEntry> loops_;
+    std::vector<double> costs_; // Of loop l, kind k at l * kinds + k.
+
+    // The loops of the function being added, and their costs.
+    SmallVector<Loop *, 8> functionLoops_;
+    std::vector<double> functionCosts_;
+};
+
+/// addFunction - Add the loops of a function. blockCosts holds the costs of
+/// one execution of block b at b * kinds.
+void LoopReport::addFunction(const Function &func, const BlockEdgeFrequencyPass &local, const LoopInfo &loopInfo,
+                             ArrayRef<double> blockCosts) {
+    if (!isEnabled())
+        return;
+
+    double scale = global_.getFrequencyScale(&func);
+    sumLoopCosts(local, loopInfo, scale, blockCosts, kinds_.size(), functionLoops_, functionCosts_);
+    for (const Loop *loop : functionLoops_) {
+        const BasicBlock *header = loop->getHeader();
+        loops_.push_back({header, local.getCFG().getBlockId(header), loop->getLoopDepth(),
+                          local.getBlockFrequency(header) * scale, local.getLoopIterations(*loop)});
+    }
+    costs_.insert(costs_.end(), functionCosts_.begin(), functionCosts_.end());
+}
+
+/// print - Print one line per loop.
+void LoopReport::print(raw_ostream &os, ArrayRef<double> totalCost) const {
+    if (!isEnabled())
+        return;
+
+    os << "Loops (";
+    for (size_t k = 0; k < kinds_.size(); ++k)
+        os << (k ? ", " : "") << kinds_[k].first;
+    os << "): header, depth, header frequency, iterations per entry, inclusive cost\n";
+    for (size_t l = 0; l < loops_.size(); ++l) {
+        const LoopEntry &loop = loops_[l];
+        os << "  ";
+        printBlockName(os, *loop.header, loop.index);
+        os << format("  depth %u  frequency %e  iterations %e  cost", loop.depth, loop.frequency, loop.iterations);
+        for (size_t k = 0; k < kinds_.size(); ++k) {
+            double cost = costs_[l * kinds_.size() + k];
+            os << format(" %e (%.1f%%)", cost, totalCost[k] ? cost / totalCost[k] * 100 : 0.0);
+        }
+        printLocation(os, *loop.header);
+        os << "\n";
+    }
+}
@@ -0,0 +1,348 @@
+/*
+ Machine-readable output of the results, streamed one function at a time.
+
+ Functions are identified by their names, blocks by their index in layout order,
+ and edges by their source block and successor index, the same numbering used
+ by BranchPredictionPass and CFGSnapshot. Frequencies are global, that is local
+ frequencies times the invocation frequency of the function. Block costs are
+ the costs of one execution of the block, and function costs are the sums of
+ the block costs times the block frequencies, as in the text report.
+
+ JSON: one object for the module,
+   {"module": ..., "cost_kinds": [...],
+    "functions": [{"name": ..., "call_frequency": ..., "cost": {kind: ...},
+                   "blocks": [{"index": ..., "name": ..., "frequency": ..., "local_frequency": ...,
+                               "cost": {kind: ...},
+                               "successors": [{"index": ..., "to": ..., "probability": ...,
+                                               "frequency": ..., "local_frequency": ...}]}]}],
+    "total_cost": {kind: ...}}
+
+ CSV: one row per record, the first column telling which one,
+   record,function,block,successor,to,probability,frequency,local_frequency,call_frequency,<one column per cost kind>
+
+ Binary: the memory-mappable file described in prediction_format.h. Its size
+ is known once algorithm 3 is done, so it is mapped for writing up front, and
+ each function is written in place.
+*/
+
+class PredictionWriter {
+public:
+    PredictionWriter(StringRef path, StringRef format, const Module &module, const FunctionCallFrequencyPass &global,
+                     ArrayRef<CostKind> kinds);
+    ~PredictionWriter();
+
+    bool isEnabled() const { return os_ || binary_; }
+    void writeFunction(const Function &func, const BlockEdgeFrequencyPass &local, ArrayRef<double> blockCosts,
+                       ArrayRef<double> cost);
+
+private:
+    const FunctionCallFrequencyPass &global_;
+    std::unique_ptr<raw_fd_ostream> os_;
+    std::unique_ptr<json::OStream> json_; // Null for CSV.
+    std::vector<CostKind> kinds_;
+    std::vector<double> totalCost_;
+
+    // Binary output, with the first block and edge of each function.
+    std::unique_ptr<FileOutputBuffer> binary_;
+    prediction_format::Header header_;
+    std::vector<uint32_t> firstBlocks_, firstEdges_;
+
+    void openBinary(StringRef path);
+    template <typename T> T *getSection(uint64_t offset) {
+        return reinterpret_cast<T *>(binary_->getBufferStart() + offset);
+    }
+    void writeBinaryFunction(const Function &func, const BlockEdgeFrequencyPass &local, ArrayRef<double> blockCosts,
+                             ArrayRef<double> cost);
+    void writeCosts(ArrayRef<double> costs);
+    void writeRow(StringRef record, StringRef function, ArrayRef<Optional<double>> fields, ArrayRef<double> costs);
+};
+
+PredictionWriter::PredictionWriter(StringRef path, StringRef format, const Module &module,
+                                   const FunctionCallFrequencyPass &global, ArrayRef<CostKind> kinds) :
+    global_(global), kinds_(kinds.begin(), kinds.end()), totalCost_(kinds.size(), 0) {
+    if (path.empty())
+        return;
+    if (format != "json" && format != "csv" && format != "binary") {
+        errs() << "WARNING! Invalid option --prediction-output-format=" << format << " using 'json' instead.\n";
+        format = "json";
+    }
+    if (format == "binary") {
+        openBinary(path);
+        return;
+    }
+
+    std::error_code error;
+    os_ = std::make_unique<raw_fd_ostream>(path, error, format == "csv" ? sys::fs::OF_Text : sys::fs::OF_None);
+    if (error) {
+        errs() << "WARNING! Cannot open " << path << ": " << error.message() << ", no output written.\n";
+        os_.reset();
+        return;
+    }
+
+    if (format == "csv") {
+        *os_ << "record,function,block,successor,to,probability,frequency,local_frequency,call_frequency";
+        for (const CostKind &kind : kinds_)
+            *os_ << "," << kind.first;
+        *os_ << "\n";
+        return;
+    }
+
+    json_ = std::make_unique<json::OStream>(*os_);
+    json_->objectBegin();
+    json_->attribute("module", module.getName());
+    json_->attributeArray("cost_kinds", [&] {
+        for (const CostKind &kind : kinds_)
+            json_->value(kind.first);
+    });
+    json_->attributeBegin("functions");
+    json_->arrayBegin();
+}
+
+/// ~PredictionWriter - Close the module with the total costs.
+PredictionWriter::~PredictionWriter() {
+    if (!isEnabled())
+        return;
+
+    if (binary_) {
+        if (Error error = binary_->commit())
+            errs() << "WARNING! Cannot write the binary output: " << toString(std::move(error)) << "\n";
+    } else if (json_) {
+        json_->arrayEnd();
+        json_->attributeEnd();
+        json_->attributeBegin("total_cost");
+        writeCosts(totalCost_);
+        json_->attributeEnd();
+        json_->objectEnd();
+        json_->flush();
+        *os_ << "\n";
+    } else {
+        writeRow("total", "", {}, totalCost_);
+    }
+}
+
+/// openBinary - Lay out the binary file, map it, and write everything known
+/// before the costs: the header, the strings, the functions and the calls.
+void PredictionWriter::openBinary(StringRef path) {
+    if (sys::IsBigEndianHost) {
+        errs() << "WARNING! The binary output is little endian, and only written on little endian hosts.\n";
+        return;
+    }
+
+    // Count the blocks, edges and string bytes.
+    prediction_format::Header &h = header_;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, prediction_format::Magic, sizeof(prediction_format::Magic));
+    h.version = prediction_format::Version;
+    h.numKinds = kinds_.size();
+    h.numFunctions = global_.getNumFunctions();
+    h.numCalls = global_.getNumCalls();
+    for (const CostKind &kind : kinds_)
+        h.stringsSize += kind.first.size() + 1;
+    firstBlocks_.resize(h.numFunctions);
+    firstEdges_.resize(h.numFunctions);
+    for (unsigned f = 0; f < h.numFunctions; ++f) {
+        const Function &func = *global_.getFunction(f);
+        firstBlocks_[f] = h.numBlocks;
+        firstEdges_[f] = h.numEdges;
+        h.numBlocks += func.size();
+        for (const BasicBlock &bb : func)
+            h.numEdges += bb.getTerminator()->getNumSuccessors();
+        h.stringsSize += func.getName().size() + 1;
+    }
+    if (h.numBlocks > UINT32_MAX || h.numEdges > UINT32_MAX || h.stringsSize > UINT32_MAX) {
+        errs() << "WARNING! The module is too large for the binary output.\n";
+        return;
+    }
+
+    // Lay out the sections.
+    uint64_t offset = sizeof(prediction_format::Header);
+    auto section = [&](uint64_t &start, uint64_t bytes) {
+        start = offset;
+        offset = alignTo(offset + bytes, prediction_format::Alignment);
+    };
+    section(h.kinds, h.numKinds * sizeof(prediction_format::String));
+    section(h.functions, h.numFunctions * sizeof(prediction_format::Function));
+    section(h.functionCosts, h.numFunctions * h.numKinds * sizeof(double));
+    section(h.blockFrequencies, h.numBlocks * sizeof(double));
+    section(h.blockCosts, h.numBlocks * h.numKinds * sizeof(double));
+    section(h.blockEdges, (h.numBlocks + 1) * sizeof(uint32_t));
+    section(h.edgeTargets, h.numEdges * sizeof(uint32_t));
+    section(h.edgeProbabilities, h.numEdges * sizeof(double));
+    section(h.edgeFrequencies, h.numEdges * sizeof(double));
+    section(h.callCallees, h.numCalls * sizeof(uint32_t));
+    section(h.callFrequencies, h.numCalls * sizeof(double));
+    section(h.strings, h.stringsSize);
+    h.fileSize = offset;
+
+    auto buffer = FileOutputBuffer::create(path, h.fileSize);
+    if (!buffer) {
+        errs() << "WARNING! Cannot open " << path << ": " << toString(buffer.takeError()) << ", no output written.\n";
+        return;
+    }
+    binary_ = std::move(*buffer);
+    memset(binary_->getBufferStart(), 0, h.fileSize);
+    memcpy(binary_->getBufferStart(), &h, sizeof(h));
+
+    char *strings = getSection<char>(h.strings);
+    uint32_t stringOffset = 0;
+    auto addString = [&](StringRef string) {
+        prediction_format::String s = {stringOffset, (uint32_t) string.size()};
+        memcpy(strings + stringOffset, string.data(), string.size());
+        stringOffset += string.size() + 1;
+        return s;
+    };
+    for (unsigned k = 0; k < h.numKinds; ++k)
+        getSection<prediction_format::String>(h.kinds)[k] = addString(kinds_[k].first);
+
+    prediction_format::Function *functions = getSection<prediction_format::Function>(h.functions);
+    for (unsigned f = 0; f < h.numFunctions; ++f) {
+        const Function &func = *global_.getFunction(f);
+        functions[f].name = addString(func.getName());
+        functions[f].firstBlock = firstBlocks_[f];
+        functions[f].numBlocks = func.size();
+        functions[f].firstCall = global_.callsBegin(f);
+        functions[f].numCalls = global_.callsEnd(f) - global_.callsBegin(f);
+        functions[f].callFrequency = global_.getCallFrequency(&func);
+        functions[f].flags = func.isDeclaration() ? prediction_format::FunctionDeclaration : 0;
+    }
+    getSection<uint32_t>(h.blockEdges)[h.numBlocks] = h.numEdges;
+
+    for (unsigned call = 0; call < h.numCalls; ++call) {
+        getSection<uint32_t>(h.callCallees)[call] = global_.getCallee(call);
+        getSection<double>(h.callFrequencies)[call] = global_.getGlobalCallFrequency(call);
+    }
+}
+
+/// writeBinaryFunction - Write the costs, blocks and edges of a function in
+/// place.
+void PredictionWriter::writeBinaryFunction(const Function &func, const BlockEdgeFrequencyPass &local,
+                                           ArrayRef<double> blockCosts, ArrayRef<double> cost) {
+    const prediction_format::Header &h = header_;
+    unsigned f = global_.getFunctionId(&func);
+    if (f == ~0U)
+        return;
+
+    const CFGSnapshot &cfg = local.getCFG();
+    const BranchPredictionPass &prediction = *local.getBranchPrediction();
+    double scale = global_.getFrequencyScale(&func);
+    uint32_t firstBlock = firstBlocks_[f], firstEdge = firstEdges_[f];
+
+    std::copy(cost.begin(), cost.end(), getSection<double>(h.functionCosts) + f * h.numKinds);
+    std::copy(blockCosts.begin(), blockCosts.end(), getSection<double>(h.blockCosts) + firstBlock * h.numKinds);
+    for (unsigned b = 0; b < cfg.getNumBlocks(); ++b) {
+        getSection<double>(h.blockFrequencies)[firstBlock + b] = local.getBlockFrequency(b) * scale;
+        getSection<uint32_t>(h.blockEdges)[firstBlock + b] = firstEdge + cfg.succBegin(b);
+    }
+    for (unsigned e = 0; e < cfg.getNumEdges(); ++e) {
+        getSection<uint32_t>(h.edgeTargets)[firstEdge + e] = cfg.getSuccessor(e);
+        getSection<double>(h.edgeProbabilities)[firstEdge + e] = prediction.getEdgeProbability(e);
+        getSection<double>(h.edgeFrequencies)[firstEdge + e] = local.getEdgeFrequency(e) * scale;
+    }
+}
+
+/// writeCosts - Write one cost per kind, as a JSON object keyed by kind.
+void PredictionWriter::writeCosts(ArrayRef<double> costs) {
+    json_->object([&] {
+        for (size_t k = 0; k < kinds_.size(); ++k)
+            json_->attribute(kinds_[k].first, costs[k]);
+    });
+}
+
+/// writeRow - Write one CSV record. Missing fields are left empty.
+void PredictionWriter::writeRow(StringRef record, StringRef function, ArrayRef<Optional<double>> fields,
+                                ArrayRef<double> costs) {
+    raw_ostream &os = *os_;
+    os << record << ",";
+    if (function.find_first_of(",\"\r\n") == StringRef::npos) {
+        os << function;
+    } else {// Quote, doubling the quotes.
+        os << '"';
+        for (char c : function)
+            os << (c == '"' ? "\"\"" : StringRef(&c, 1));
+        os << '"';
+    }
+
+    const unsigned numFields = 7; // block ... call_frequency.
+    for (unsigned f = 0; f < numFields; ++f) {
+        os << ",";
+        if (f < fields.size() && fields[f])
+            os << format("%.17g", *fields[f]);
+    }
+    for (size_t k = 0; k < kinds_.size(); ++k) {
+        os << ",";
+        if (!costs.empty())
+            os << format("%.17g", costs[k]);
+    }
+    os << "\n";
+}
+
+/// writeFunction - Write the records of a function, its blocks and its edges.
+/// blockCosts holds the costs of block b at b * kinds, and cost the cost of
+/// the whole function.
+void PredictionWriter::writeFunction(const Function &func, const BlockEdgeFrequencyPass &local,
+                                     ArrayRef<double> blockCosts, ArrayRef<double> cost) {
+    if (!isEnabled())
+        return;
+    if (binary_) {
+        writeBinaryFunction(func, local, blockCosts, cost);
+        return;
+    }
+
+    const CFGSnapshot &cfg = local.getCFG();
+    const BranchPredictionPass &prediction = *local.getBranchPrediction();
+    double scale = global_.getFrequencyScale(&func);
+    double callFrequency = global_.getCallFrequency(&func);
+    for (size_t k = 0; k < kinds_.size(); ++k)
+        totalCost_[k] += cost[k];
+
+    if (!json_) {
+        writeRow("function", func.getName(), {None, None, None, None, None, None, callFrequency}, cost);
+        for (unsigned b = 0; b < cfg.getNumBlocks(); ++b) {
+            double freq = local.getBlockFrequency(b);
+            writeRow("block", func.getName(), {(double) b, None, None, None, freq * scale, freq},
+                     blockCosts.slice(b * kinds_.size(), kinds_.size()));
+            for (unsigned e = cfg.succBegin(b); e != cfg.succEnd(b); ++e)
+                writeRow("edge", func.getName(), {(double) b, (double) (e - cfg.succBegin(b)),
+                         (double) cfg.getSuccessor(e), prediction.getEdgeProbability(e),
+                         local.getEdgeFrequency(e) * scale, local.getEdgeFrequency(e)}, {});
+        }
+        return;
+    }
+
+    json::OStream &json = *json_;
+    json.object([&] {
+        json.attribute("name", func.getName());
+        json.attribute("call_frequency", callFrequency);
+        json.attributeBegin("cost");
+        writeCosts(cost);
+        json.attributeEnd();
+        json.attributeArray("blocks", [&] {
+            for (unsigned b = 0; b < cfg.getNumBlocks(); ++b) {
+                json.object([&] {
+                    double freq = local.getBlockFrequency(b);
+                    json.attribute("index", b);
+                    if (cfg.getBlock(b)->hasName())
+                        json.attribute("name", cfg.getBlock(b)->getName());
+                    json.attribute("frequency", freq * scale);
+                    json.attribute("local_frequency", freq);
+                    json.attributeBegin("cost");
+                    writeCosts(blockCosts.slice(b * kinds_.size(), kinds_.size()));
+                    json.attributeEnd();
+                    json.attributeArray("successors", [&] {
+                        for (unsigned e = cfg.succBegin(b); e != cfg.succEnd(b); ++e) {
+                            json.object([&] {
+                                json.attribute("index", e - cfg.succBegin(b));
+                                json.attribute("to", cfg.getSuccessor(e));
+                                json.attribute("probability", prediction.getEdgeProbability(e));
+                                json.attribute("frequency", local.getEdgeFrequency(e) * scale);
+                                json.attribute("local_frequency", local.getEdgeFrequency(e));
+                            });
+                        }
+                    });
+                });
+            }
+        });
+    });
+    // Let the consumer see each function as soon as it is complete.
+    json.flush();
+}
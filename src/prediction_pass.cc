@@ -1,41 +1,105 @@
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/SCCIterator.h>
 #include <llvm/ADT/SmallSet.h>
-#include <llvm/Analysis/CallGraph.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Analysis/BlockFrequencyInfo.h>
+#include <llvm/Analysis/BranchProbabilityInfo.h>
 #include <llvm/Analysis/LoopInfo.h>
 #include <llvm/Analysis/Passes.h>
 #include <llvm/Analysis/PostDominators.h>
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
 #include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/InstrTypes.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/IR/PassTimingInfo.h>
+#include <llvm/IR/ProfileSummary.h>
 #include <llvm/Pass.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
+#include <llvm/ProfileData/ProfileCommon.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Allocator.h>
 #include <llvm/Support/Compiler.h>
 #include <llvm/Support/Debug.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/EndianStream.h>
+#include <llvm/Support/FileOutputBuffer.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/LineIterator.h>
 #include <llvm/Support/Format.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <llvm/Support/Timer.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <atomic>
 #include <map>
 #include <set>
 #include <utility>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <thread>
 
 using namespace std;
 using namespace llvm;
 
+#define DEBUG_TYPE "prediction_pass"
+
+#include "prediction_timer.cc"
+#include "prediction_arena.cc"
 #include "wu_larus/A1.Branch_prediction/branch_prediction_pass.cc"
 #include "wu_larus/A2.Block_edge_frequency/block_edge_frequency_pass.cc"
 #include "wu_larus/A3.Function_call_frequency/function_call_frequency_pass.cc"
+#include "instruction_cost_cache.cc"
+#include "prediction_cache.cc"
+#include "prediction_format.h"
+#include "prediction_output.cc"
+#include "prediction_hot_spots.cc"
+#include "prediction_loops.cc"
+
+/// PredictionReport - The costs found by a run of the pass, one per cost kind.
+struct PredictionReport {
+    vector<CostKind> kinds;
+    vector<double> total_cost;
+    map<std::string, vector<double>> function_costs;
+};
 
 struct PredictionPass : public llvm::PassInfoMixin<PredictionPass> {
+    PredictionPass(PredictionReport *report = nullptr) : report_(report) {}
+
     llvm::PreservedAnalyses run(llvm::Module &, llvm::ModuleAnalysisManager &);
+
+private:
+    PredictionReport *report_; // The report is printed to errs() when null.
+
+    llvm::PreservedAnalyses runBoundedMemory(llvm::Module &, llvm::ModuleAnalysisManager &, ArrayRef<CostKind> kinds);
+    void printReport(ArrayRef<CostKind> kinds, ArrayRef<double> total_cost, const FunctionCallFrequencyPass &global,
+                     ArrayRef<double> function_costs);
 };
 
 cl::opt<std::string> cost_opt(
@@ -44,66 +108,419 @@ cl::opt<std::string> cost_opt(
 //    cl::init("recipthroughput"),
 //    cl::init("codesize"),
 //    cl::init("sizeandlatency"),
-    cl::desc("Specify cost kind used"),
-    cl::value_desc("one of: recipthroughput, latency, codesize, sizeandlatency"));
+    cl::desc("Specify cost kind used, a comma separated list of them, or all"),
+    cl::value_desc("one of: recipthroughput, latency, codesize, sizeandlatency, all"));
+
+cl::opt<unsigned> threads_opt(
+    "prediction-threads",
+    cl::init(1),
+    cl::desc("Number of threads running algorithms 1 and 2 (0 uses every hardware thread)"),
+    cl::value_desc("N"));
+
+cl::opt<bool> cost_cache_opt(
+    "prediction-cost-cache",
+    cl::init(true),
+    cl::desc("Reuse the costs of instructions of the same shape"));
+
+cl::opt<std::string> cache_dir_opt(
+    "prediction-cache-dir",
+    cl::init(""),
+    cl::desc("Keep the results of algorithms 1 and 2 and the block costs of each function in this directory, "
+             "and reuse them for unchanged functions"),
+    cl::value_desc("directory"));
+
+cl::opt<std::string> output_opt(
+    "prediction-output",
+    cl::init(""),
+    cl::desc("Write the per-function, per-block and per-edge results to this file ('-' for stdout)"),
+    cl::value_desc("filename"));
+
+cl::opt<std::string> output_format_opt(
+    "prediction-output-format",
+    cl::init("json"),
+    cl::desc("Format of the --prediction-output file"),
+    cl::value_desc("one of: json, csv, binary"));
+
+cl::opt<bool> annotate_opt(
+    "prediction-annotate",
+    cl::init(false),
+    cl::desc("Write the branch probabilities as !prof branch_weights, and the call frequencies as "
+             "synthetic function entry counts"));
+
+cl::opt<unsigned> hot_spots_opt(
+    "prediction-hot-spots",
+    cl::init(0),
+    cl::desc("After the report, list the N blocks, loops and functions of highest frequency times cost, "
+             "with their share of the total cost and their source location"),
+    cl::value_desc("N"));
+
+cl::opt<bool> loops_opt(
+    "prediction-loops",
+    cl::init(false),
+    cl::desc("After the report, list every loop with its depth, header frequency, average iterations per entry "
+             "and inclusive cost"));
+
+cl::opt<bool> bounded_memory_opt(
+    "prediction-bounded-memory",
+    cl::init(false),
+    cl::desc("Keep only the call edges and the costs of each function once it is analysed, and read the bodies "
+             "of lazily loaded modules one at a time. Incompatible with --prediction-output, "
+             "--prediction-annotate, --prediction-hot-spots, --prediction-loops and --prediction-threads"));
+
+cl::opt<bool> memory_report_opt(
+    "prediction-memory-report",
+    cl::init(false),
+    cl::desc("Print the bytes held by the arena of the run, and by the results of algorithms 1 and 2"));
+
+cl::opt<unsigned> entry_count_opt(
+    "prediction-entry-count",
+    cl::init(10),
+    cl::desc("Synthetic entry count of a function called once, as with -initial-synthetic-count"),
+    cl::value_desc("N"));
+
+static const CostKind cost_kinds[] = {
+    {"recipthroughput", TargetTransformInfo::TargetCostKind::TCK_RecipThroughput},
+    {"latency", TargetTransformInfo::TargetCostKind::TCK_Latency},
+    {"codesize", TargetTransformInfo::TargetCostKind::TCK_CodeSize},
+    {"sizeandlatency", TargetTransformInfo::TargetCostKind::TCK_SizeAndLatency},
+};
+
+/// getResultOptions - The options, besides the cost kinds, that change the
+/// results of a function, and thus key its entries in the cache directory.
+static std::string getResultOptions() {
+    SmallVector<std::string, 4> options {};
+    if (loop_local_opt)
+        options.push_back("loop-local");
+    if (trip_counts_opt)
+        options.push_back("trip-counts");
+    if (useMarkovSolver()) { // Unconverged frequencies depend on when the solver stops.
+        options.emplace_back();
+        raw_string_ostream(options.back()) << format("markov:%.17g:%u", markov_tolerance_opt.getValue(),
+                                                     markov_iterations_opt.getValue());
+    }
+    return join(options, ",");
+}
+
+/// parseCostKinds - Get the cost kinds requested by --prediction-cost-kind.
+static vector<CostKind> parseCostKinds() {
+    if (cost_opt == "all")
+        return vector<CostKind>(std::begin(cost_kinds), std::end(cost_kinds));
+
+    SmallVector<StringRef, 4> names;
+    StringRef(cost_opt).split(names, ',', -1, false);
+
+    vector<CostKind> kinds = {};
+    for (StringRef name : names) {
+        name = name.trim();
+        auto kind = find_if(std::begin(cost_kinds), std::end(cost_kinds),
+                            [&](const CostKind &k) { return k.first == name; });
+        if (kind == std::end(cost_kinds) && names.size() > 1)
+            errs() << "WARNING! Invalid cost kind '" << name << "' in --prediction-cost-kind=" << cost_opt << ", ignoring it.\n";
+        else if (kind != std::end(cost_kinds) && find(kinds.begin(), kinds.end(), *kind) == kinds.end())
+            kinds.push_back(*kind);
+    }
+    if (kinds.empty()) {// Default to latency.
+        errs() << "WARNING! Invalid option --prediction-cost-kind=" << cost_opt << " using 'latency' instead.\n";
+        kinds.push_back(cost_kinds[1]);
+    }
+    return kinds;
+}
+
+/// registerPredictionAnalyses - Make wu's algorithms 1 and 2 available on a
+/// function analysis manager.
+static void registerPredictionAnalyses(FunctionAnalysisManager &fam) {
+    fam.registerPass([] { return BranchPredictionAnalysis(); });
+    fam.registerPass([] { return BlockEdgeFrequencyAnalysis(); });
+}
+
+/// registerPredictionAnalyses - Make wu's algorithm 3 available on a module
+/// analysis manager.
+static void registerPredictionAnalyses(ModuleAnalysisManager &mam) {
+    mam.registerPass([] { return FunctionCallFrequencyAnalysis(); });
+}
+
+/// SyntheticSummaryBuilder - The profile summary of the synthetic entry counts
+/// written by the pass, and of the block counts they imply. ProfileSummary has
+/// no synthetic kind, so it is attached as an instrumentation summary. Its hot
+/// and cold thresholds only apply to the counts of consumers allowing synthetic
+/// ones, as BlockFrequencyInfo::getBlockProfileCount(BB, true) does: the entry
+/// count queries of ProfileSummaryInfo ignore synthetic counts.
+class SyntheticSummaryBuilder : public ProfileSummaryBuilder {
+public:
+    SyntheticSummaryBuilder() : ProfileSummaryBuilder(DefaultCutoffs.vec()) {}
+
+    /// addFunction - Count a function of this entry count, and its blocks.
+    void addFunction(uint64_t entry_count, const BlockEdgeFrequencyPass &local) {
+        ++NumFunctions;
+        addCount(entry_count);
+        MaxFunctionCount = std::max(MaxFunctionCount, entry_count);
+        const CFGSnapshot &cfg = local.getCFG();
+        for (unsigned b = 1; b < cfg.getNumBlocks(); ++b) {
+            double count = local.getBlockFrequency(b) * entry_count + 0.5;
+            uint64_t block_count = count > 1e18 ? (uint64_t) 1e18 : (uint64_t) count;
+            addCount(block_count);
+            max_internal_count_ = std::max(max_internal_count_, block_count);
+        }
+    }
+
+    /// getSummary - The summary, or null when no function was counted.
+    unique_ptr<ProfileSummary> getSummary() {
+        if (!NumFunctions)
+            return nullptr;
+        computeDetailedSummary();
+        return make_unique<ProfileSummary>(ProfileSummary::PSK_Instr, DetailedSummary, TotalCount, MaxCount,
+                                           max_internal_count_, MaxFunctionCount, NumCounts, NumFunctions);
+    }
+
+private:
+    uint64_t max_internal_count_ = 0;
+};
+
+/// annotateFunction - Write the branch probabilities of algorithm 1 on the
+/// conditional branches and switches of a function, and its invocation
+/// frequency from algorithm 3 as its entry count, which is added to the
+/// summary. Functions never called from the roots of algorithm 3 are left
+/// without an entry count: they may be called from outside.
+static void annotateFunction(Function &func, const BlockEdgeFrequencyPass &local,
+                             const FunctionCallFrequencyPass &global, SyntheticSummaryBuilder &summary) {
+    // Weights of probability 1 and 0. Edges are never given a 0 weight, since
+    // the heuristics only tell unlikely from likely.
+    const double weight_scale = 1 << 20;
+
+    const CFGSnapshot &cfg = local.getCFG();
+    const BranchPredictionPass &prediction = *local.getBranchPrediction();
+    MDBuilder builder {func.getContext()};
+    SmallVector<uint32_t, 8> weights {};
+    for (unsigned b = 0; b < cfg.getNumBlocks(); ++b) {
+        Instruction *TI = const_cast<BasicBlock *>(cfg.getBlock(b))->getTerminator();
+        if (!(isa<BranchInst>(TI) && cast<BranchInst>(TI)->isConditional()) && !isa<SwitchInst>(TI))
+            continue;
+
+        // The probability of an edge is shared by all the successor slots
+        // leading to the same block, while branch weights add up.
+        SmallDenseMap<unsigned, unsigned, 8> slots {};
+        for (unsigned e = cfg.succBegin(b); e != cfg.succEnd(b); ++e)
+            ++slots[cfg.getSuccessor(e)];
+        weights.clear();
+        for (unsigned e = cfg.succBegin(b); e != cfg.succEnd(b); ++e) {
+            double weight = prediction.getEdgeProbability(e) / slots[cfg.getSuccessor(e)] * weight_scale;
+            weights.push_back(std::max<uint32_t>(1, weight + 0.5));
+        }
+        TI->setMetadata(LLVMContext::MD_prof, builder.createBranchWeights(weights));
+    }
+
+    double count = global.getCallFrequency(&func) * entry_count_opt + 0.5;
+    if (count > 0.5) {
+        uint64_t entry_count = count < 1 ? 1 : count > 1e18 ? (uint64_t) 1e18 : (uint64_t) count;
+        func.setEntryCount(entry_count, Function::PCT_Synthetic);
+        summary.addFunction(entry_count, local);
+    }
+}
+
+/// sumBlockCosts - The costs of one execution of each block of func, block b
+/// and kind k at b * kinds + k. Functions may have their own cpu and features,
+/// and thus their own costs, so the instruction cost caches are per target.
+static void sumBlockCosts(Function &func, FunctionAnalysisManager &fam, ArrayRef<CostKind> kinds,
+                          StringMap<unique_ptr<InstructionCostCache>> &cost_caches, vector<double> &block_costs) {
+    TargetTransformInfo &tira = fam.getResult<TargetIRAnalysis>(func);
+    auto &cost_cache = cost_caches[(func.getFnAttribute("target-cpu").getValueAsString() + "," +
+                                    func.getFnAttribute("target-features").getValueAsString()).str()];
+    if (!cost_cache)
+        cost_cache = make_unique<InstructionCostCache>(kinds, cost_cache_opt);
+
+    block_costs.assign(func.size() * kinds.size(), 0);
+    double *bcost = block_costs.data();
+    for (BasicBlock &bb : func) {
+        cost_cache->addBlockCosts(bb, tira, MutableArrayRef<double>(bcost, kinds.size()));
+//        errs() << "Block [" << bb.getName() << "] / Cost = [" << bcost[0] << "]\n";
+        bcost += kinds.size();
+    }
+}
+
+/// printMemoryReport - Print the bytes held by the arena of a run, and by the
+/// results of algorithms 1 and 2, which the analysis managers own.
+static void printMemoryReport(const PredictionArena &arena, size_t result_bytes, const Twine &results) {
+    errs() << "Arena: " << arena.getBytesUsed() << " bytes used, " << arena.getBytesReserved() << " reserved\n";
+    errs() << "Results of algorithms 1 and 2: " << result_bytes << " bytes " << results << "\n";
+}
+
+/// getResultBytes - Bytes held by the results of algorithms 1 and 2 of a function.
+static size_t getResultBytes(const BlockEdgeFrequencyPass &local) {
+    return sizeof(BlockEdgeFrequencyPass) + local.getMemoryUsage() + sizeof(BranchPredictionPass) +
+           local.getBranchPrediction()->getMemoryUsage();
+}
+
+/// storeCacheEntry - Store the results of algorithms 1 and 2 of a function
+/// in the cache directory, with its block costs already in the entry.
+static void storeCacheEntry(const PredictionCache &cache, StringRef key, const BlockEdgeFrequencyPass &local,
+                            PredictionCache::Entry &entry) {
+    const CFGSnapshot &cfg = local.getCFG();
+    ArrayRef<double> probabilities = local.getBranchPrediction()->getEdgeProbabilities();
+    entry.edgeProbabilities.assign(probabilities.begin(), probabilities.end());
+    entry.blockFrequencies.resize(cfg.getNumBlocks());
+    for (unsigned b = 0; b < cfg.getNumBlocks(); ++b)
+        entry.blockFrequencies[b] = local.getBlockFrequency(b);
+    entry.edgeFrequencies.resize(cfg.getNumEdges());
+    for (unsigned e = 0; e < cfg.getNumEdges(); ++e)
+        entry.edgeFrequencies[e] = local.getEdgeFrequency(e);
+    cache.store(key, entry);
+    ++NumPredictionCacheMisses;
+}
 
 llvm::PreservedAnalyses PredictionPass::run(llvm::Module &module, llvm::ModuleAnalysisManager &mam) {
-    map<Function *, BranchPredictionPass *> function_branch_prediction_results {};
-    map<Function *, BlockEdgeFrequencyPass *> function_block_edge_frequency_results {};
-    PassBuilder pb;
-    FunctionAnalysisManager fam;
-    pb.registerFunctionAnalyses(fam);
+    FunctionAnalysisManager &fam = mam.getResult<FunctionAnalysisManagerModuleProxy>(module).getManager();
+
+    // All the requested cost kinds are queried in the same walk over the instructions.
+    vector<CostKind> kinds = parseCostKinds();
+    if (bounded_memory_opt)
+        return runBoundedMemory(module, mam, kinds);
+
+    // What the run keeps for the whole module, freed at once when it returns.
+    PredictionArena arena {};
 
 //    errs() << "Module: " << module.getName() << "\n";
-    for (Function &func : module) {// Run wu's algorithms 1 and 2 for each function.
+    vector<Function *> functions {};
+    for (Function &func : module) {
         // Skip declared only functions (prototypes).
         if (func.empty() && !func.isMaterializable()) continue;
 //        func.viewCFG();
-        // Algorithm 1.
-        BranchPredictionPass *branchPredictionPass = new BranchPredictionPass;
-        branchPredictionPass->run(func, fam);
-
-        // Algorithm 2.
-        BlockEdgeFrequencyPass *blockEdgeFrequencyPass = new BlockEdgeFrequencyPass{branchPredictionPass};
-        blockEdgeFrequencyPass->run(func, fam);
-
-        // Preserve the analysis passes data for Algorithm 3.
-        function_branch_prediction_results[&func] = branchPredictionPass;
-        function_block_edge_frequency_results[&func] = blockEdgeFrequencyPass;
-    }
-    // Algorithm 3.
-    FunctionCallFrequencyPass functionCallFrequencyPass {
-        &function_branch_prediction_results,
-        &function_block_edge_frequency_results
-    };
-    functionCallFrequencyPass.run(module);
+        functions.push_back(&func);
+    }
+
+    unsigned num_threads = threads_opt ? threads_opt : hardware_concurrency().compute_thread_count();
+    num_threads = std::min<size_t>(num_threads, functions.size());
+    if (num_threads > 1 && trip_counts_opt) {
+        // ScalarEvolution interns constants and registers value handles in the
+        // LLVMContext, which the threads share.
+        errs() << "WARNING! --prediction-use-trip-counts runs ScalarEvolution, which is not thread safe, "
+               << "ignoring --prediction-threads.\n";
+        num_threads = 1;
+    }
+
+    // Per-thread analysis managers. They are kept alive until the end of the run,
+    // since they own the results of algorithms 1 and 2 computed by the threads.
+    vector<unique_ptr<FunctionAnalysisManager>> thread_fams {};
+    vector<BlockEdgeFrequencyPass *> block_edge_frequency_results(functions.size(), nullptr);
+    FunctionCallFrequencyPass thread_call_frequency_results {};
+    const FunctionCallFrequencyPass *functionCallFrequencyPass;
+
+    // Functions found in the cache directory are restored instead of analysed.
+    PredictionCache cache {cache_dir_opt, kinds, getResultOptions()};
+    vector<string> cache_keys(functions.size());
+    vector<PredictionCache::Entry> cache_entries(functions.size());
+    BitVector cached(functions.size());
+    if (cache.isEnabled()) {
+        for (size_t i = 0; i < functions.size(); ++i) {
+            PredictionCache::Entry &entry = cache_entries[i];
+            cache_keys[i] = cache.getKey(*functions[i]);
+            if (!cache.lookup(cache_keys[i], *functions[i], entry)) continue;
+
+            BranchPredictionPass *prediction = arena.create<BranchPredictionPass>();
+            prediction->restore(*functions[i], entry.edgeProbabilities);
+            block_edge_frequency_results[i] = arena.create<BlockEdgeFrequencyPass>(prediction);
+            block_edge_frequency_results[i]->restore(*functions[i], entry.blockFrequencies, entry.edgeFrequencies);
+            cached.set(i);
+            ++NumPredictionCacheHits;
+        }
+    }
+
+    if (num_threads <= 1) {
+        // Run wu's algorithms 1 and 2 through the pipeline's analysis managers,
+        // reusing their dominator and loop trees, and caching the results there.
+        for (size_t i = 0; i < functions.size(); ++i)
+            if (!cached.test(i))
+                block_edge_frequency_results[i] = &fam.getResult<BlockEdgeFrequencyAnalysis>(*functions[i]);
+    } else {
+        // The timers of the threads only show in -time-trace, so the whole parallel
+        // section is timed here.
+        PredictionTimer timer {"PredictionThreads", "Branch prediction and frequencies on threads (A1 and A2)"};
+
+        // Analysis managers are not thread safe, so each thread gets its own.
+        PassBuilder pb;
+        for (unsigned t = 0; t < num_threads; ++t) {
+            thread_fams.push_back(make_unique<FunctionAnalysisManager>());
+            pb.registerFunctionAnalyses(*thread_fams.back());
+            registerPredictionAnalyses(*thread_fams.back());
+        }
+        // Functions are handed out one at a time, so that a few huge functions do not
+        // leave the other threads idle. Each thread only writes its own analysis
+        // manager and result slots. The analyses run here only read the bodies of
+        // their functions, and leave the shared LLVMContext alone: ScalarEvolution,
+        // which does not, is never run on the threads.
+        std::atomic<size_t> next_function {0};
+        ThreadPool pool {hardware_concurrency(num_threads)};
+        for (unsigned t = 0; t < num_threads; ++t) {
+            pool.async([&, t]() {
+                FunctionAnalysisManager &tfam = *thread_fams[t];
+                for (size_t i = next_function++; i < functions.size(); i = next_function++)
+                    if (!cached.test(i))
+                        block_edge_frequency_results[i] = &tfam.getResult<BlockEdgeFrequencyAnalysis>(*functions[i]);
+            });
+        }
+        pool.wait();
+    }
+
+    // Preserve the analysis passes data for Algorithm 3.
+    DenseMap<Function *, BlockEdgeFrequencyPass *> function_block_edge_frequency_results {};
+    function_block_edge_frequency_results.reserve(functions.size());
+    for (size_t i = 0; i < functions.size(); ++i)
+        function_block_edge_frequency_results[functions[i]] = block_edge_frequency_results[i];
+
+    // Algorithm 3. The cached module analysis is only complete when every
+    // function was analysed on the pipeline's manager.
+    if (num_threads <= 1 && !cache.isEnabled()) {
+        functionCallFrequencyPass = &mam.getResult<FunctionCallFrequencyAnalysis>(module);
+    } else {
+        thread_call_frequency_results.run(module, function_block_edge_frequency_results);
+        functionCallFrequencyPass = &thread_call_frequency_results;
+    }
 
     //*TargetTransformInfo TTI = &getAnalysis().getTTI(fn);
     //TTI->getInstructionCost(Inst, TargetTransformInfo::TargetCostKind::TCK_RecipThroughput)
 
-    TargetTransformInfo::TargetCostKind cost_kind =
-        cost_opt == "recipthroughput" ? TargetTransformInfo::TargetCostKind::TCK_RecipThroughput :
-        cost_opt == "codesize" ? TargetTransformInfo::TargetCostKind::TCK_CodeSize :
-        cost_opt == "sizeandlatency" ? TargetTransformInfo::TargetCostKind::TCK_SizeAndLatency :
-        cost_opt == "latency" ? TargetTransformInfo::TargetCostKind::TCK_Latency :
-        ((errs() << "WARNING! Invalid option --prection-cost-kind=" << cost_opt << " using 'latency' instead.\n"),
-         cost_opt = "latency", TargetTransformInfo::TargetCostKind::TCK_Latency); // Default to latency.
+    // Results are written as soon as each function is complete.
+    PredictionWriter writer {output_opt, output_format_opt, module, *functionCallFrequencyPass, kinds};
+    HotSpotReport hot_spots {report_ ? 0u : hot_spots_opt.getValue(), *functionCallFrequencyPass, kinds};
+    LoopReport loops {!report_ && loops_opt, *functionCallFrequencyPass, kinds};
 
-    double total_cost = 0;
-    map<llvm::StringRef, double> function_costs = {};
-    for (Function &func : module) {
-        TargetTransformInfo &tira = fam.getResult<TargetIRAnalysis>(func);
-        function_costs[func.getName()] = 0;
-        for (BasicBlock &bb : func) {
-            for (Instruction &instr : bb) {
-                InstructionCost cost = tira.getInstructionCost(&instr, cost_kind);
-                if (cost.getValue().hasValue()) {
-                    double icost = cost.getValue().getValue();
-                    function_costs[func.getName()] += icost * function_block_edge_frequency_results[&func]->getBlockFrequency(&bb);
-                    total_cost += icost * function_block_edge_frequency_results[&func]->getBlockFrequency(&bb);
-//                    errs() << "Instruction [" << instr << "] / Cost = [" << icost << "]\n";
+    // Cost of function f, kind k at f * kinds + k.
+    vector<double> total_cost(kinds.size(), 0);
+    MutableArrayRef<double> function_costs =
+        arena.allocate<double>(functionCallFrequencyPass->getNumFunctions() * kinds.size());
+    StringMap<unique_ptr<InstructionCostCache>> cost_caches = {}; // One per target.
+    {
+        // Writing the results is timed with the costs, since it is interleaved with them.
+        PredictionTimer timer {"PredictionCosts", "Costs of the blocks"};
+        for (size_t i = 0; i < functions.size(); ++i) {
+            Function &func = *functions[i];
+            BlockEdgeFrequencyPass &local = *block_edge_frequency_results[i];
+            MutableArrayRef<double> fcost =
+                function_costs.slice(functionCallFrequencyPass->getFunctionId(&func) * kinds.size(), kinds.size());
+
+            // Sum the costs of each block, unless they were cached.
+            PredictionCache::Entry &entry = cache_entries[i];
+            if (!cached.test(i)) {
+                sumBlockCosts(func, fam, kinds, cost_caches, entry.blockCosts);
+                if (cache.isEnabled())
+                    storeCacheEntry(cache, cache_keys[i], local, entry);
+            }
+
+            // Multiply the sums by the block frequency.
+            const double *bcost = entry.blockCosts.data();
+            for (BasicBlock &bb : func) {
+                double bfreq = functionCallFrequencyPass->getGlobalBlockFrequency(local, &bb);
+                for (size_t k = 0; k < kinds.size(); ++k) {
+                    fcost[k] += bcost[k] * bfreq;
+                    total_cost[k] += bcost[k] * bfreq;
                 }
+                bcost += kinds.size();
             }
+            writer.writeFunction(func, local, entry.blockCosts, fcost);
+            if (hot_spots.isEnabled())
+                hot_spots.addFunction(func, local, fam.getResult<LoopAnalysis>(func), entry.blockCosts, fcost);
+            if (loops.isEnabled())
+                loops.addFunction(func, local, fam.getResult<LoopAnalysis>(func), entry.blockCosts);
+            entry = PredictionCache::Entry();
         }
     }
 /*
@@ -111,13 +528,181 @@ llvm::PreservedAnalyses PredictionPass::run(llvm::Module &module, llvm::ModuleAn
            << "Cost opt [" << cost_opt << "] // "
            << "Result = [" << total_cost << "]\n";
 */
-    errs() << "Cost kind: " << cost_opt << "\n";
-    errs() << "Total cost: " << total_cost << "\n";
-    for (const auto &fcost : function_costs) {
-        errs() << fcost.first << ": " << fcost.second << "\n";
+    printReport(kinds, total_cost, *functionCallFrequencyPass, function_costs);
+    hot_spots.print(errs(), total_cost);
+    loops.print(errs(), total_cost);
+    if (memory_report_opt) {
+        size_t result_bytes = 0;
+        for (const BlockEdgeFrequencyPass *local : block_edge_frequency_results)
+            result_bytes += getResultBytes(*local);
+        printMemoryReport(arena, result_bytes, "for " + Twine(functions.size()) + " functions");
+    }
+
+    if (!annotate_opt)
+        return llvm::PreservedAnalyses::all();
+
+    // Annotate the IR. Only metadata and entry counts change, so the CFG stays
+    // valid, and so do the results of wu's algorithms, which never read them.
+    // LLVM's own branch probabilities and block frequencies are read from the
+    // branch weights, so they are out of date.
+    SyntheticSummaryBuilder summary_builder {};
+    for (size_t i = 0; i < functions.size(); ++i)
+        annotateFunction(*functions[i], *block_edge_frequency_results[i], *functionCallFrequencyPass,
+                         summary_builder);
+
+    // The summary replaces any profile summary of the module. A cached profile
+    // summary analysis only reads it if it had found none.
+    if (unique_ptr<ProfileSummary> summary = summary_builder.getSummary()) {
+        module.setProfileSummary(summary->getMD(module.getContext()), ProfileSummary::PSK_Instr);
+        if (ProfileSummaryInfo *psi = mam.getCachedResult<ProfileSummaryAnalysis>(module))
+            psi->refresh();
     }
 
-    return llvm::PreservedAnalyses::all();
+    PreservedAnalyses pa;
+    pa.preserveSet<CFGAnalyses>();
+    pa.preserve<FunctionAnalysisManagerModuleProxy>();
+    pa.preserve<BranchPredictionAnalysis>();
+    pa.preserve<BlockEdgeFrequencyAnalysis>();
+    pa.preserve<FunctionCallFrequencyAnalysis>();
+    pa.abandon<BranchProbabilityAnalysis>();
+    pa.abandon<BlockFrequencyAnalysis>();
+    return pa;
+}
+
+/// runBoundedMemory - Run the pass keeping, once each function is analysed,
+/// only what algorithm 3 and the costs need: the call edges of the function,
+/// and its cost for one invocation, the sum of its block costs times their
+/// local frequencies. The analyses of the function are then freed, and so is
+/// its body when it was loaded lazily, as getLazyIRFileModule does, so that a
+/// single function body is in memory at a time.
+llvm::PreservedAnalyses PredictionPass::runBoundedMemory(llvm::Module &module, llvm::ModuleAnalysisManager &mam,
+                                                         ArrayRef<CostKind> kinds) {
+    FunctionAnalysisManager &fam = mam.getResult<FunctionAnalysisManagerModuleProxy>(module).getManager();
+    if (!output_opt.empty() || annotate_opt || hot_spots_opt || loops_opt)
+        errs() << "WARNING! --prediction-output, --prediction-annotate, --prediction-hot-spots and --prediction-loops "
+               << "need every function kept, ignoring them with --prediction-bounded-memory.\n";
+    if (threads_opt != 1)
+        errs() << "WARNING! --prediction-bounded-memory analyses one function at a time, "
+               << "ignoring --prediction-threads.\n";
+
+    PredictionArena arena {};
+    PredictionCache cache {cache_dir_opt, kinds, getResultOptions()};
+    StringMap<unique_ptr<InstructionCostCache>> cost_caches = {}; // One per target.
+    FunctionCallFrequencyPass global {};
+    global.startCalls(module);
+
+    // Cost of one invocation of function f, kind k at f * kinds + k, then its
+    // cost for the whole run.
+    MutableArrayRef<double> function_costs = arena.allocate<double>(global.getNumFunctions() * kinds.size());
+    size_t result_bytes = 0; // Of the largest function.
+    bool released = false;
+    for (Function &func : module) {
+        bool lazy = func.isMaterializable();
+        if (lazy) {
+            if (Error error = func.materialize()) {
+                errs() << "WARNING! Cannot read the body of " << func.getName() << ": " << toString(std::move(error))
+                       << ", skipping it.\n";
+                continue;
+            }
+        }
+        if (func.isDeclaration()) continue;
+
+        {
+            // Functions found in the cache directory are restored instead of analysed.
+            PredictionCache::Entry entry {};
+            std::string key = cache.isEnabled() ? cache.getKey(func) : std::string();
+            BranchPredictionPass restored_prediction {};
+            Optional<BlockEdgeFrequencyPass> restored_frequencies {};
+            const BlockEdgeFrequencyPass *local;
+            if (cache.isEnabled() && cache.lookup(key, func, entry)) {
+                restored_prediction.restore(func, entry.edgeProbabilities);
+                restored_frequencies.emplace(&restored_prediction);
+                restored_frequencies->restore(func, entry.blockFrequencies, entry.edgeFrequencies);
+                local = restored_frequencies.getPointer();
+                ++NumPredictionCacheHits;
+            } else {
+                local = &fam.getResult<BlockEdgeFrequencyAnalysis>(func);
+                PredictionTimer timer {"PredictionCosts", "Costs of the blocks"};
+                sumBlockCosts(func, fam, kinds, cost_caches, entry.blockCosts);
+                if (cache.isEnabled())
+                    storeCacheEntry(cache, key, *local, entry);
+            }
+
+            global.addCalls(func, *local);
+            result_bytes = std::max(result_bytes, getResultBytes(*local));
+            double *lcost = &function_costs[global.getFunctionId(&func) * kinds.size()];
+            const double *bcost = entry.blockCosts.data();
+            for (BasicBlock &bb : func) {
+                double bfreq = local->getBlockFrequency(&bb);
+                for (size_t k = 0; k < kinds.size(); ++k)
+                    lcost[k] += bcost[k] * bfreq;
+                bcost += kinds.size();
+            }
+        }
+
+        fam.clear(func, func.getName());
+        if (lazy) {
+            func.deleteBody();
+            released = true;
+        }
+    }
+    global.finishCalls();
+
+    // The global costs are the local ones times the invocation frequency.
+    vector<double> total_cost(kinds.size(), 0);
+    for (unsigned f = 0; f < global.getNumFunctions(); ++f) {
+        double scale = global.getFrequencyScale(global.getFunction(f));
+        for (size_t k = 0; k < kinds.size(); ++k) {
+            function_costs[f * kinds.size() + k] *= scale;
+            total_cost[k] += function_costs[f * kinds.size() + k];
+        }
+    }
+    printReport(kinds, total_cost, global, function_costs);
+    if (memory_report_opt)
+        printMemoryReport(arena, result_bytes, "for the largest function, the others being freed");
+
+    // Lazily loaded bodies are gone.
+    return released ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
+
+/// printReport - Hand the costs to the report, or print them. The cost of
+/// function f of global, kind k, is at function_costs[f * kinds + k]. Functions
+/// are listed by name, and those sharing a name, as unnamed ones do, add up.
+void PredictionPass::printReport(ArrayRef<CostKind> kinds, ArrayRef<double> total_cost,
+                                 const FunctionCallFrequencyPass &global, ArrayRef<double> function_costs) {
+    vector<unsigned> order(global.getNumFunctions());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+        return global.getFunction(a)->getName() < global.getFunction(b)->getName();
+    });
+    vector<StringRef> names {};
+    vector<double> costs {}; // Of name n, kind k at n * kinds + k.
+    for (unsigned f : order) {
+        StringRef name = global.getFunction(f)->getName();
+        if (names.empty() || names.back() != name) {
+            names.push_back(name);
+            costs.resize(costs.size() + kinds.size(), 0);
+        }
+        for (size_t k = 0; k < kinds.size(); ++k)
+            costs[costs.size() - kinds.size() + k] += function_costs[f * kinds.size() + k];
+    }
+
+    if (report_) {
+        report_->kinds = kinds;
+        report_->total_cost = total_cost;
+        report_->function_costs.clear();
+        for (size_t n = 0; n < names.size(); ++n)
+            report_->function_costs[names[n].str()].assign(&costs[n * kinds.size()], &costs[(n + 1) * kinds.size()]);
+    }
+
+    // One report per cost kind, the same as separate runs would print.
+    for (size_t k = 0; k < kinds.size() && !report_; ++k) {
+        errs() << "Cost kind: " << kinds[k].first << "\n";
+        errs() << "Total cost: " << total_cost[k] << "\n";
+        for (size_t n = 0; n < names.size(); ++n) {
+            errs() << names[n] << ": " << costs[n * kinds.size() + k] << "\n";
+        }
+    }
 }
 
 extern "C" LLVM_ATTRIBUTE_WEAK llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
@@ -125,6 +710,10 @@ extern "C" LLVM_ATTRIBUTE_WEAK llvm::PassPluginLibraryInfo llvmGetPassPluginInfo
         LLVM_PLUGIN_API_VERSION, "prediction_pass",
         LLVM_VERSION_STRING,
         [](llvm::PassBuilder &pb) {
+            pb.registerAnalysisRegistrationCallback(
+                [](llvm::FunctionAnalysisManager &fam) { registerPredictionAnalyses(fam); });
+            pb.registerAnalysisRegistrationCallback(
+                [](llvm::ModuleAnalysisManager &mam) { registerPredictionAnalyses(mam); });
             pb.registerPipelineParsingCallback(
                 [](llvm::StringRef name, llvm::ModulePassManager &fpm, llvm::ArrayRef <llvm::PassBuilder::PipelineElement>) {
                     if (name == "prediction_pass") {
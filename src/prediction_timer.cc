@@ -0,0 +1,23 @@
+/*
+ Timers of the phases of the prediction.
+
+ Each phase shows in -time-trace, with the function it ran over as detail, and
+ in the "prediction" group of -time-passes. The timers of -time-passes cannot
+ be shared between threads, so only the phases run on the thread that loaded
+ the pass are counted there; -time-trace follows each thread it was enabled on.
+*/
+
+static const std::thread::id prediction_timer_thread = std::this_thread::get_id();
+
+/// PredictionTimer - Time the enclosing scope as the given phase.
+class PredictionTimer {
+public:
+    PredictionTimer(StringRef name, StringRef description, const Function *func = nullptr) :
+        trace_(name, [func]() { return func ? func->getName().str() : std::string(); }),
+        timer_(name, description, "prediction", "Wu-Larus static profile",
+               TimePassesIsEnabled && std::this_thread::get_id() == prediction_timer_thread) {}
+
+private:
+    TimeTraceScope trace_;
+    NamedRegionTimer timer_;
+};
@@ -0,0 +1,96 @@
+#!/bin/bash
+
+#
+# Times algorithm 2 on synthetic functions with a growing number of
+# sequential loops, with and without --prediction-loop-local, and with
+# the markov solver. The time per loop should stay flat with
+# --prediction-loop-local and with the markov solver.
+#
+# $1 = LLVM directory (default /usr/lib/llvm-15)
+# $2 = loop counts (default "1000 2000 4000 8000")
+# $3 = loop nest depth (default 1)
+#
+# Run from src/, after build.sh.
+#
+
+PASSNAME="prediction_pass"
+PLUGIN=build/lib${PASSNAME}.so
+
+if [[ $1 ]]; then
+    LLVM_DIR=$1
+else
+    LLVM_DIR=/usr/lib/llvm-15
+fi
+SIZES=${2:-"1000 2000 4000 8000"}
+DEPTH=${3:-1}
+
+function seconds() {
+    t=`date +"%H:%M:%S:%N" | awk -F: '{printf "%f", ($1 * 3600) + ($2 * 60) + $3 + ($4 / 1000000000)}'` ;
+    echo ${t}
+}
+
+function elapsed() {
+    seconds=`echo "${1} ${2}" | sed -u 's/,/./g' | awk '{printf "%.4f", $2 - $1}'` ;
+    echo ${seconds}
+}
+
+# Write a function with $1 sequential loop nests of depth $2 to stdout.
+# Each innermost body holds a diamond, so that algorithm 1 has branches
+# to predict besides the loop branches.
+function generate() {
+    awk -v loops=$1 -v depth=$2 'BEGIN {
+        print "@g = global i32 0"
+        print "define i32 @main(i32 %n) {"
+        print "entry:"
+        print "  br label %L0_h0"
+        for (i = 0; i < loops; i++) {
+            for (d = 0; d < depth; d++) {
+                if (d == 0)
+                    from = (i == 0) ? "entry" : "L" (i - 1) "_x0"
+                else
+                    from = "L" i "_h" (d - 1)
+                printf "L%d_h%d:\n", i, d
+                printf "  %%i%d_%d = phi i32 [ 0, %%%s ], [ %%n%d_%d, %%L%d_l%d ]\n", i, d, from, i, d, i, d
+                if (d + 1 < depth)
+                    printf "  br label %%L%d_h%d\n", i, d + 1
+                else
+                    printf "  br label %%L%d_b\n", i
+            }
+            printf "L%d_b:\n  %%c%d = icmp sgt i32 %%n, %d\n", i, i, i
+            printf "  br i1 %%c%d, label %%L%d_t, label %%L%d_l%d\n", i, i, i, depth - 1
+            printf "L%d_t:\n  store i32 %d, i32* @g\n  br label %%L%d_l%d\n", i, i, i, depth - 1
+            for (d = depth - 1; d >= 0; d--) {
+                printf "L%d_l%d:\n  %%n%d_%d = add i32 %%i%d_%d, 1\n", i, d, i, d, i, d
+                printf "  %%e%d_%d = icmp slt i32 %%n%d_%d, %%n\n", i, d, i, d
+                printf "  br i1 %%e%d_%d, label %%L%d_h%d, label %%L%d_x%d\n", i, d, i, d, i, d
+                printf "L%d_x%d:\n", i, d
+                if (d > 0)
+                    printf "  br label %%L%d_l%d\n", i, d - 1
+            }
+            if (i + 1 < loops)
+                printf "  br label %%L%d_h0\n", i + 1
+            else
+                print "  br label %exit"
+        }
+        print "exit:"
+        print "  ret i32 0"
+        print "}"
+    }'
+}
+
+echo "loops, depth, default (s), loop-local (s), markov (s)"
+for loops in ${SIZES}; do
+    generate ${loops} ${DEPTH} > loop_scaling.ll
+
+    row="${loops}, ${DEPTH}"
+    for mode in "" "--prediction-loop-local" "--prediction-block-freq-solver=markov"; do
+        initial_time=`seconds`
+        $LLVM_DIR/bin/opt -load ${PLUGIN} -load-pass-plugin ${PLUGIN} -passes="${PASSNAME}" \
+            -disable-output loop_scaling.ll ${mode} &> /dev/null
+        final_time=`seconds`
+        row="${row}, `elapsed $initial_time $final_time`"
+    done
+    echo "${row}"
+done
+
+rm -f loop_scaling.ll
@@ -0,0 +1,189 @@
+/*
+  prediction_batch - Run the prediction pass over many modules in one process.
+
+  Usage: prediction_batch [options] <file or directory>... [-j N] [-o report]
+
+  Directories are searched recursively for .bc and .ll files, and lists of
+  files can be given as @response files. The modules are analysed by a pool
+  of N workers, each loading one module at a time in its own LLVMContext, so
+  that at most N modules are in memory, or at most N function bodies with
+  --prediction-bounded-memory. Every --prediction-* option of the
+  pass applies, except --prediction-output, --prediction-hot-spots and
+  --prediction-loops, which are per module.
+
+  The report has the same layout as the one of the pass, with one line per
+  module instead of one per function, followed by the modules that failed.
+*/
+
+#include "prediction_pass.cc"
+
+#include <llvm/ADT/Triple.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <chrono>
+
+static cl::list<std::string> inputs_opt(
+    cl::Positional,
+    cl::OneOrMore,
+    cl::desc("<.bc, .ll files or directories>"));
+
+static cl::opt<unsigned> jobs_opt(
+    "j",
+    cl::init(0),
+    cl::desc("Number of modules analysed, and kept in memory, at the same time (0 uses every hardware thread)"),
+    cl::value_desc("N"));
+
+static cl::opt<std::string> report_opt(
+    "o",
+    cl::init("-"),
+    cl::desc("Write the aggregated report to this file"),
+    cl::value_desc("filename"));
+
+/// ModuleResult - What is kept of each module once it is analysed.
+struct ModuleResult {
+    std::string error; // Empty on success.
+    vector<double> total_cost;
+    size_t functions = 0;
+};
+
+/// findInputs - Expand the directories among the inputs into the .bc and .ll
+/// files they hold, in a stable order.
+static vector<std::string> findInputs() {
+    vector<std::string> files {};
+    for (const std::string &input : inputs_opt) {
+        if (!sys::fs::is_directory(input)) {
+            files.push_back(input);
+            continue;
+        }
+        vector<std::string> found {};
+        std::error_code error;
+        for (sys::fs::recursive_directory_iterator I(input, error), E; I != E && !error; I.increment(error)) {
+            StringRef extension = sys::path::extension(I->path());
+            if ((extension == ".bc" || extension == ".ll") && !sys::fs::is_directory(I->path()))
+                found.push_back(I->path());
+        }
+        if (error)
+            errs() << "WARNING! Cannot read the directory " << input << ": " << error.message() << "\n";
+        std::sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    return files;
+}
+
+/// analyseModule - Load one module in its own context, and run the pass over
+/// it with the analysis managers opt would set up for its target. With
+/// --prediction-bounded-memory, bitcode is loaded lazily, so that the pass
+/// reads and frees the function bodies one at a time.
+static void analyseModule(const std::string &path, ModuleResult &result) {
+    LLVMContext context;
+    SMDiagnostic diagnostic;
+    std::unique_ptr<Module> module = bounded_memory_opt ? getLazyIRFileModule(path, diagnostic, context)
+                                                        : parseIRFile(path, diagnostic, context);
+    if (!module) {
+        raw_string_ostream os(result.error);
+        diagnostic.print(nullptr, os, false);
+        return;
+    }
+
+    // Costs depend on the target, as in opt, which also falls back on the
+    // generic cost model when the target is unknown.
+    std::string error;
+    Triple triple(module->getTargetTriple());
+    std::unique_ptr<TargetMachine> target_machine {};
+    if (const Target *target = TargetRegistry::lookupTarget(triple.str(), error))
+        target_machine.reset(target->createTargetMachine(triple.str(), "", "", TargetOptions(), None));
+
+    LoopAnalysisManager lam;
+    FunctionAnalysisManager fam;
+    CGSCCAnalysisManager cgam;
+    ModuleAnalysisManager mam;
+    PassBuilder pb {target_machine.get()};
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+    registerPredictionAnalyses(fam);
+    registerPredictionAnalyses(mam);
+
+    PredictionReport report {};
+    ModulePassManager mpm;
+    mpm.addPass(PredictionPass(&report));
+    mpm.run(*module, mam);
+
+    result.total_cost = std::move(report.total_cost);
+    result.functions = report.function_costs.size();
+}
+
+int main(int argc, char **argv) {
+    InitLLVM init {argc, argv};
+    InitializeAllTargetInfos();
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    cl::ParseCommandLineOptions(argc, argv, "Wu-Larus static profile of many modules\n");
+
+    if (!output_opt.empty()) {
+        errs() << "WARNING! --prediction-output is per module, and ignored by " << argv[0] << ".\n";
+        output_opt = "";
+    }
+
+    vector<std::string> files = findInputs();
+    vector<ModuleResult> results(files.size());
+    unsigned num_jobs = jobs_opt ? jobs_opt : hardware_concurrency().compute_thread_count();
+    num_jobs = std::max<size_t>(1, std::min<size_t>(num_jobs, files.size()));
+
+    // Modules are handed out one at a time, so that each worker holds a single
+    // module, and a few huge modules do not leave the other workers idle.
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> next_file {0};
+    ThreadPool pool {hardware_concurrency(num_jobs)};
+    for (unsigned j = 0; j < num_jobs; ++j) {
+        pool.async([&]() {
+            for (size_t i = next_file++; i < files.size(); i = next_file++)
+                analyseModule(files[i], results[i]);
+        });
+    }
+    pool.wait();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::error_code error;
+    raw_fd_ostream os {report_opt, error, sys::fs::OF_Text};
+    if (error) {
+        errs() << "ERROR! Cannot open " << report_opt << ": " << error.message() << "\n";
+        return 1;
+    }
+
+    // One report per cost kind, with one line per module.
+    vector<CostKind> kinds = parseCostKinds();
+    size_t failed = 0, functions = 0;
+    for (size_t k = 0; k < kinds.size(); ++k) {
+        double total_cost = 0;
+        for (const ModuleResult &result : results)
+            if (result.error.empty())
+                total_cost += result.total_cost[k];
+        os << "Cost kind: " << kinds[k].first << "\n";
+        os << "Total cost: " << total_cost << "\n";
+        for (size_t i = 0; i < files.size(); ++i)
+            if (results[i].error.empty())
+                os << files[i] << ": " << results[i].total_cost[k] << "\n";
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (results[i].error.empty()) {
+            functions += results[i].functions;
+        } else {
+            os << "Failed: " << results[i].error;
+            ++failed;
+        }
+    }
+    os << "Modules: " << files.size() - failed << " analysed, " << failed << " failed, " << functions
+       << " functions, " << format("%.3f", elapsed.count()) << "s with " << num_jobs
+       << " workers\n";
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+/*
+  prediction_dump - Print a binary result file of the prediction pass.
+
+  Usage: prediction_dump <file> [function]
+
+  Only the functions named on the command line are printed, or all of them.
+  The file is mapped and read in place through prediction_format.h, as any
+  other consumer would.
+*/
+
+#include "prediction_format.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+using namespace prediction_format;
+
+static void printCosts(const Reader &reader, const double *costs) {
+    for (uint32_t k = 0; k < reader.numKinds(); ++k)
+        printf(" %s=%g", reader.str(reader.kind(k)), costs[k]);
+}
+
+static void printFunction(const Reader &reader, uint64_t f) {
+    const Function &func = reader.function(f);
+    printf("function %s%s: call frequency %g, cost", reader.str(func.name),
+           func.flags & FunctionDeclaration ? " (declaration)" : "", func.callFrequency);
+    printCosts(reader, reader.functionCosts(f));
+    printf("\n");
+
+    for (uint32_t b = 0; b < func.numBlocks; ++b) {
+        uint64_t block = func.firstBlock + b;
+        printf("  block %u: frequency %g, cost", b, reader.blockFrequency(block));
+        printCosts(reader, reader.blockCosts(block));
+        printf("\n");
+        for (uint32_t e = reader.edgesBegin(block); e != reader.edgesEnd(block); ++e)
+            printf("    -> block %u: probability %g, frequency %g\n", reader.edgeTarget(e),
+                   reader.edgeProbability(e), reader.edgeFrequency(e));
+    }
+    for (uint32_t c = func.firstCall; c != func.firstCall + func.numCalls; ++c)
+        printf("  calls %s: frequency %g\n", reader.str(reader.function(reader.callee(c)).name),
+               reader.callFrequency(c));
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [function...]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    void *data = st.st_size ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    Reader reader;
+    if (data == MAP_FAILED || !reader.open(data, st.st_size)) {
+        fprintf(stderr, "%s: not a prediction file of version %u\n", argv[1], Version);
+        return 1;
+    }
+
+    printf("version %u: %" PRIu64 " functions, %" PRIu64 " blocks, %" PRIu64 " edges, %" PRIu64 " calls\n",
+           reader.header().version, reader.numFunctions(), reader.numBlocks(), reader.numEdges(),
+           reader.numCalls());
+    for (uint64_t f = 0; f < reader.numFunctions(); ++f) {
+        bool print = argc == 2;
+        for (int a = 2; a < argc && !print; ++a)
+            print = !strcmp(argv[a], reader.str(reader.function(f).name));
+        if (print)
+            printFunction(reader, f);
+    }
+
+    munmap(data, st.st_size);
+    return 0;
+}
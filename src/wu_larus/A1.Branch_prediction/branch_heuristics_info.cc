@@ -34,6 +34,26 @@ struct BranchProbabilities {
 
 typedef std::pair<const ::llvm::BasicBlock *, const ::llvm::BasicBlock *> Prediction;
 
+/// BranchFeatures - Everything the heuristics look at to predict a two-way
+/// branch, gathered in a single scan of the branch. Index 0 stands for the
+/// true successor, and 1 for the false one.
+struct BranchFeatures {
+    bool isBranch;          // A conditional branch, rather than a two-way switch.
+    bool inLoop;            // The branch is within a loop.
+    bool backEdge[2];       // The edge to the successor is a back edge,
+    bool exitEdge[2];       // or a loop exit edge.
+    bool loopHeader[2];     // The successor is a loop header,
+    bool loopEntry[2];      // or the header or pre-header of its innermost loop.
+    bool postDominates[2];  // The successor post-dominates the branch.
+    bool hasCall[2];
+    bool hasStore[2];
+    bool returns[2];
+    uint8_t guardUses[2];   // Operands of the comparison used in the successor,
+                            // when it does not post-dominate.
+    int8_t pointerTaken;    // Successor predicted by the pointer heuristic, or -1.
+    int8_t opcodeTaken;     // Successor predicted by the opcode heuristic, or -1.
+};
+
 class BranchHeuristicsInfo {
 private:
     BranchPredictionInfo *branchPredictionInfo_;
@@ -45,21 +65,16 @@ private:
     static const unsigned numBranchHeuristics_ = 9;
     static const struct BranchProbabilities probList[numBranchHeuristics_];
 
-    Prediction matchLoopBranchHeuristic(::llvm::BasicBlock *root) const;
-    Prediction matchPointerHeuristic(::llvm::BasicBlock *root) const;
-    Prediction matchCallHeuristic(::llvm::BasicBlock *root) const;
-    Prediction matchOpcodeHeuristic(::llvm::BasicBlock *root) const;
-    Prediction matchLoopExitHeuristic(::llvm::BasicBlock *root) const;
-    Prediction matchReturnHeuristic(::llvm::BasicBlock *root) const;
-    Prediction matchStoreHeuristic(::llvm::BasicBlock *root) const;
-    Prediction matchLoopHeaderHeuristic(::llvm::BasicBlock *root) const;
-    Prediction matchGuardHeuristic(::llvm::BasicBlock *root) const;
+    static int opcodeTaken(const ::llvm::ICmpInst *II);
+    static int predictEither(bool taken0, bool taken1);
 public:
 
     typedef std::pair<const ::llvm::BasicBlock *, const ::llvm::BasicBlock *> Edge;
 
     explicit BranchHeuristicsInfo(BranchPredictionInfo *BPI);
 
+    BranchFeatures extractFeatures(::llvm::BasicBlock *root) const;
+    int predict(BranchHeuristics bh, const BranchFeatures &features) const;
     Prediction matchHeuristic(BranchHeuristics bh, ::llvm::BasicBlock *root) const;
 
     inline static unsigned getNumHeuristics() { return numBranchHeuristics_; }
@@ -95,472 +110,168 @@ BranchHeuristicsInfo::BranchHeuristicsInfo(BranchPredictionInfo *BPI) {
     empty = std::make_pair((BasicBlock *) NULL, (BasicBlock *) NULL);
 }
 
-/// MatchHeuristic - Wrapper for the heuristics handlers meet above.
-/// This procedure assumes that root basic block has exactly two successors.
+/// MatchHeuristic - Match a single heuristic. This procedure assumes that
+/// root basic block has exactly two successors.
 /// @returns a Prediction that is a pair in which the first element is the
 /// successor taken, and the second the successor not taken.
 Prediction BranchHeuristicsInfo::matchHeuristic(BranchHeuristics bh, BasicBlock *root) const {
-    // Try to match the heuristic bh with their respective handler.
-    switch (bh) {
-    case LOOP_BRANCH_HEURISTIC:
-        return matchLoopBranchHeuristic(root);
-    case POINTER_HEURISTIC:
-        return matchPointerHeuristic(root);
-    case CALL_HEURISTIC:
-        return matchCallHeuristic(root);
-    case OPCODE_HEURISTIC:
-        return matchOpcodeHeuristic(root);
-    case LOOP_EXIT_HEURISTIC:
-        return matchLoopExitHeuristic(root);
-    case RETURN_HEURISTIC:
-        return matchReturnHeuristic(root);
-    case STORE_HEURISTIC:
-        return matchStoreHeuristic(root);
-    case LOOP_HEADER_HEURISTIC:
-        return matchLoopHeaderHeuristic(root);
-    case GUARD_HEURISTIC:
-        return matchGuardHeuristic(root);
-    default: // ERROR.
-        exit(1);
-    }
-}
-
-/// MatchLoopBranchHeuristic - Predict as taken an edge back to a loop's
-/// head. Predict as not taken an edge exiting a loop.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchLoopBranchHeuristic(BasicBlock *root) const {
-    bool matched = false;
-    Prediction pred;
-
-    // Last instruction of basic block.
-    Instruction *TI = root->getTerminator();
-
-    // Basic block successors. True and False branches.
-    BasicBlock *trueSuccessor = TI->getSuccessor(0);
-    BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-    // True and false branch edges.
-    Edge trueEdge = std::make_pair(root, trueSuccessor);
-    Edge falseEdge = std::make_pair(root, falseSuccessor);
-
-    // If the true branch is a back edge to a loop's head or the false branch is
-    // an exit edge, match the heuristic.
-    if ((branchPredictionInfo_->isBackEdge(trueEdge) && loopInfo_->isLoopHeader(trueSuccessor)) ||
-        branchPredictionInfo_->isExitEdge(falseEdge)) {
-        matched = true;
-        pred = std::make_pair(trueSuccessor, falseSuccessor);
-    }
-
-    // Check the opposite situation, the other branch.
-    if ((branchPredictionInfo_->isBackEdge(falseEdge) && loopInfo_->isLoopHeader(falseSuccessor)) ||
-        branchPredictionInfo_->isExitEdge(trueEdge)) {
-        // If the heuristic matches both branches, predict none.
-        if (matched)
-            return empty;
-
-        matched = true;
-        pred = std::make_pair(falseSuccessor, trueSuccessor);
-    }
-
-    return (matched ? pred : empty);
-}
-
-/// MatchPointerHeuristic - Predict that a comparison of a pointer against
-/// null or of two pointers will fail.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchPointerHeuristic(BasicBlock *root) const {
-    // Last instruction of basic block.
-    Instruction *TI = root->getTerminator();
-
-    // Basic block successors. True and False branches.
-    BasicBlock *trueSuccessor = TI->getSuccessor(0);
-    BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-    // Is the last instruction a Branch Instruction?
-    BranchInst *BI = dyn_cast<BranchInst>(TI);
-    if (!BI || !BI->isConditional())
-        return empty;
-
-    // Conditional instruction.
-    Value *cond = BI->getCondition();
-
-    // Pointer comparisons are integer comparisons.
-    ICmpInst *II = dyn_cast<ICmpInst>(cond);
-    if (!II)
+    int taken = predict(bh, extractFeatures(root));
+    if (taken < 0)
         return empty;
 
-    // An integer comparison has always to operands.
-    Value *operand1 = II->getOperand(0);
-    Value *operand2 = II->getOperand(1);
-
-    // Obtain the type of comparison.
-    enum ICmpInst::Predicate signedPred = II->getSignedPredicate();
-
-    // The heuristic states that it must be compared against null,
-    // but in LLVM, null is also a PointerType, so it only requires
-    // to test if there is a comparison between two pointers.
-    if (signedPred == ICmpInst::ICMP_EQ &&
-        isa<PointerType>(operand1->getType()) && // NULL is a pointer type too
-        isa<PointerType>(operand2->getType())) { // NULL is a pointer type too
-        return std::make_pair(falseSuccessor, trueSuccessor);
-    } else if (signedPred != ICmpInst::ICMP_EQ &&
-               isa<PointerType>(operand1->getType()) &&
-               isa<PointerType>(operand2->getType())) {
-        return std::make_pair(trueSuccessor, falseSuccessor);
-    }
-
-    return empty;
+    Instruction *TI = root->getTerminator();
+    return std::make_pair(TI->getSuccessor(taken), TI->getSuccessor(1 - taken));
 }
 
-/// MatchCallHeuristic - Predict a successor that contains a call and does
-/// not post-dominate will not be taken.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchCallHeuristic(BasicBlock *root) const {
-    bool matched = false;
-    Prediction pred;
+/// ExtractFeatures - Gather the inputs of every heuristic for the two-way
+/// branch ending root, querying the branch prediction info, the loop info
+/// and the post-dominator tree once per successor.
+BranchFeatures BranchHeuristicsInfo::extractFeatures(BasicBlock *root) const {
+    BranchFeatures features;
 
     // Last instruction of basic block.
     Instruction *TI = root->getTerminator();
-
-    // Basic block successors. True and False branches.
-    BasicBlock *trueSuccessor = TI->getSuccessor(0);
-    BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-    // Check if the successor contains a call and does not post-dominate.
-    if (branchPredictionInfo_->hasCall(trueSuccessor) &&
-        !postDominatorTree_->dominates(trueSuccessor, root)) {
-        matched = true;
-        pred = std::make_pair(falseSuccessor, trueSuccessor);
+    features.inLoop = loopInfo_->getLoopFor(root) != nullptr;
+
+    for (unsigned s = 0; s < 2; ++s) {
+        BasicBlock *successor = TI->getSuccessor(s);
+        Edge edge = std::make_pair(root, successor);
+        Loop *loop = loopInfo_->getLoopFor(successor);
+
+        features.backEdge[s] = branchPredictionInfo_->isBackEdge(edge);
+        features.exitEdge[s] = branchPredictionInfo_->isExitEdge(edge);
+        features.loopHeader[s] = loop && loop->getHeader() == successor;
+        features.loopEntry[s] = loop && (features.loopHeader[s] || loop->getLoopPreheader() == successor);
+        features.postDominates[s] = postDominatorTree_->dominates(successor, root);
+        features.hasCall[s] = branchPredictionInfo_->hasCall(successor);
+        features.hasStore[s] = branchPredictionInfo_->hasStore(successor);
+        features.returns[s] = isa<ReturnInst>(successor->getTerminator());
+        features.guardUses[s] = 0;
     }
+    features.pointerTaken = -1;
+    features.opcodeTaken = -1;
 
-    // Check the opposite situation, the other branch.
-    if (branchPredictionInfo_->hasCall(falseSuccessor) &&
-        !postDominatorTree_->dominates(falseSuccessor, root)) {
-        // If the heuristic matches both branches, predict none.
-        if (matched)
-            return empty;
-
-        matched = true;
-        pred = std::make_pair(trueSuccessor, falseSuccessor);
+    // The pointer, opcode and guard heuristics look at the comparison of a
+    // conditional branch.
+    BranchInst *BI = dyn_cast<BranchInst>(TI);
+    features.isBranch = BI && BI->isConditional();
+    CmpInst *CI = features.isBranch ? dyn_cast<CmpInst>(BI->getCondition()) : nullptr;
+    if (!CI)
+        return features;
+
+    if (ICmpInst *II = dyn_cast<ICmpInst>(CI)) {
+        // The heuristic states that it must be compared against null,
+        // but in LLVM, null is also a PointerType, so it only requires
+        // to test if there is a comparison between two pointers.
+        if (isa<PointerType>(II->getOperand(0)->getType()) && isa<PointerType>(II->getOperand(1)->getType()))
+            features.pointerTaken = II->getSignedPredicate() == ICmpInst::ICMP_EQ ? 1 : 0;
+        features.opcodeTaken = opcodeTaken(II);
     }
 
-    return (matched ? pred : empty);
+    // Since LLVM is in SSA form, it's impossible for a variable being used
+    // before being defined, so only the uses are checked.
+    for (unsigned ops = 0; ops < CI->getNumOperands(); ++ops) {
+        Value *operand = CI->getOperand(ops);
+        if (!isa<Argument>(operand) && !isa<User>(operand))
+            continue;
+        for (unsigned s = 0; s < 2; ++s)
+            if (!features.postDominates[s] && operand->isUsedInBasicBlock(TI->getSuccessor(s)))
+                ++features.guardUses[s];
+    }
+    return features;
 }
 
-/// MatchOpcodeHeuristic - Predict that a comparison of an integer for less
-/// than zero, less than or equal to zero, or equal to a constant, will
-/// fail.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchOpcodeHeuristic(BasicBlock *root) const {
-    // Last instruction of basic block.
-    Instruction *TI = root->getTerminator();
-
-    // Basic block successors, the true and false branches.
-    BasicBlock *trueSuccessor = TI->getSuccessor(0);
-    BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-    // Is the last instruction a Branch Instruction?
-    BranchInst *BI = dyn_cast<BranchInst>(TI);
-    if (!BI || !BI->isConditional())
-        return empty;
-
-    // Conditional instruction.
-    Value *cond = BI->getCondition();
-
-    // Heuristics can only apply to integer comparisons.
-    ICmpInst *II = dyn_cast<ICmpInst>(cond);
-    if (!II)
-        return empty;
-
+/// OpcodeTaken - Predict that a comparison of an integer for less than zero,
+/// less than or equal to zero, or equal to a constant, will fail.
+/// @returns the successor taken, or -1 if the heuristic does not match.
+int BranchHeuristicsInfo::opcodeTaken(const ICmpInst *II) {
     // An integer comparison has always to operands.
-    Value *operand1 = II->getOperand(0);
-    ConstantInt *op1const = dyn_cast<ConstantInt>(operand1);
-
-    Value *operand2 = II->getOperand(1);
-    ConstantInt *op2const = dyn_cast<ConstantInt>(operand2);
-
-    // The type of comparison used.
-    enum ICmpInst::Predicate pred = II->getUnsignedPredicate();
-
-    // The return successors (the first taken and the second not taken).
-    Edge falseEdge = std::make_pair(falseSuccessor, trueSuccessor);
-    Edge trueEdge  = std::make_pair(trueSuccessor, falseSuccessor);
+    const ConstantInt *op1const = dyn_cast<ConstantInt>(II->getOperand(0));
+    const ConstantInt *op2const = dyn_cast<ConstantInt>(II->getOperand(1));
 
     // Check several comparison operators.
-    switch (pred) {
+    switch (II->getUnsignedPredicate()) {
     case ICmpInst::ICMP_EQ: // if ($var == constant) or if (constant == $var).
-        // If it's a equal comparison against a constant integer, match.
-        if (op1const || op2const)
-            return falseEdge;
-
-        break;
+        return op1const || op2const ? 1 : -1;
     case ICmpInst::ICMP_NE: // if ($var != constant) or if (constant != $var).
-        // If it's a not equal comparison against a constant integer, match.
-        if (op1const || op2const)
-            return trueEdge;
-
-        break;
+        return op1const || op2const ? 0 : -1;
     case ICmpInst::ICMP_SLT: // if ($var < 0) or if (0 < $var).
     case ICmpInst::ICMP_ULT:
-        if (!op1const && (op2const && op2const->isZero()))
-            return falseEdge;
-        else if (!op2const && (op1const && op1const->isZero()))
-            return trueEdge;
-
-        break;
     case ICmpInst::ICMP_SLE: // if ($var <= 0) or if (0 <= $var).
     case ICmpInst::ICMP_ULE:
         if (!op1const && (op2const && op2const->isZero()))
-            return falseEdge;
+            return 1;
         else if (!op2const && (op1const && op1const->isZero()))
-            return trueEdge;
-
-        break;
+            return 0;
+        return -1;
     case ICmpInst::ICMP_SGT: // if ($var > 0) or if (0 > $var).
     case ICmpInst::ICMP_UGT:
-        if (!op1const && (op2const && op2const->isZero()))
-            return trueEdge;
-        else if (!op2const && (op1const && op1const->isZero()))
-            return falseEdge;
-
-        break;
     case ICmpInst::ICMP_SGE: // if ($var >= 0) or if (0 >= $var).
     case ICmpInst::ICMP_UGE:
         if (!op1const && (op2const && op2const->isZero()))
-            return trueEdge;
+            return 0;
         else if (!op2const && (op1const && op1const->isZero()))
-            return falseEdge;
-
-        break;
+            return 1;
+        return -1;
     default: // Do not process any other comparison operators.
-        break;
-    }
-
-    // Heuristic not matched.
-    return empty;
-}
-
-/// MatchLoopExitHeuristic - Predict that a comparison in a loop in which no
-/// successor is a loop head will not exit the loop.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchLoopExitHeuristic(BasicBlock *root) const {
-    // Last instruction of basic block.
-    Instruction *TI = root->getTerminator();
-
-    // Basic block successors. True and False branches.
-    BasicBlock *trueSuccessor = TI->getSuccessor(0);
-    BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-    // Get the most inner loop in which this basic block is in.
-    Loop *loop = loopInfo_->getLoopFor(root);
-
-    // If there's a loop, check if neither of the branches are loop headers.
-    if (!loop || loopInfo_->isLoopHeader(trueSuccessor) ||
-        loopInfo_->isLoopHeader(falseSuccessor))
-        return empty;
-
-    // True and false branch edges.
-    Edge trueEdge = std::make_pair(root, trueSuccessor);
-    Edge falseEdge = std::make_pair(root, falseSuccessor);
-
-    // If it is an exit edge, successor will fail so predict the other branch.
-    // Note that is not possible for both successors to be exit edges.
-    if (branchPredictionInfo_->isExitEdge(trueEdge))
-        return std::make_pair(falseSuccessor, trueSuccessor);
-    else if (branchPredictionInfo_->isExitEdge(falseEdge))
-        return std::make_pair(trueSuccessor, falseSuccessor);
-
-    return empty;
-}
-
-/// MatchReturnHeuristic - Predict a successor that contains a return will
-/// not be taken.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchReturnHeuristic(BasicBlock *root) const {
-    bool matched = false;
-    Prediction pred;
-
-    // Last instruction of basic block.
-    Instruction *TI = root->getTerminator();
-
-    // Basic block successors. True and False branches.
-    BasicBlock *trueSuccessor = TI->getSuccessor(0);
-    BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-    // Check if the true successor it's a return instruction.
-    if (isa<ReturnInst>(trueSuccessor->getTerminator())) {
-        matched = true;
-        pred = std::make_pair(falseSuccessor, trueSuccessor);
-    }
-
-    // Check the opposite situation, the other branch.
-    if (isa<ReturnInst>(falseSuccessor->getTerminator())) {
-        // If the heuristic matches both branches, predict none.
-        if (matched)
-            return empty;
-
-        matched = true;
-        pred = std::make_pair(trueSuccessor, falseSuccessor);
-    }
-
-    return (matched ? pred : empty);
-}
-
-/// MatchStoreHeuristic - Predict a successor that contains a store
-/// instruction and does not post-dominate will not be taken.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchStoreHeuristic(BasicBlock *root) const {
-    bool matched = false;
-    Prediction pred;
-
-    // Last instruction of basic block.
-    Instruction *TI = root->getTerminator();
-
-    // Basic block successors. True and False branches.
-    BasicBlock *trueSuccessor = TI->getSuccessor(0);
-    BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-    // Check if the successor contains a store and does not post-dominate.
-    if (branchPredictionInfo_->hasStore(trueSuccessor) &&
-        !postDominatorTree_->dominates(trueSuccessor, root)) {
-        matched = true;
-        pred = std::make_pair(falseSuccessor, trueSuccessor);
+        return -1;
     }
-
-    // Check the opposite situation, the other branch.
-    if (branchPredictionInfo_->hasStore(falseSuccessor) &&
-        !postDominatorTree_->dominates(falseSuccessor, root)) {
-// If the heuristic matches both branches, predict none.
-    if (matched)
-      return empty;
-
-    matched = true;
-    pred = std::make_pair(trueSuccessor, falseSuccessor);
-  }
-
-  return (matched ? pred : empty);
 }
 
-/// MatchLoopHeaderHeuristic - Predict a successor that is a loop header or
-/// a loop pre-header and does not post-dominate will be taken.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchLoopHeaderHeuristic(BasicBlock *root) const {
-  bool matched = false;
-  Prediction pred;
-
-  // Last instruction of basic block.
-  Instruction *TI = root->getTerminator();
-
-  // Basic block successors. True and False branches.
-  BasicBlock *trueSuccessor = TI->getSuccessor(0);
-  BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-  // Get the most inner loop in which the true successor basic block is in.
-  Loop *loop = loopInfo_->getLoopFor(trueSuccessor);
-
-  // Check if exists a loop, the true branch successor is a loop header or a
-  // loop pre-header, and does not post dominate.
-  if (loop && (trueSuccessor == loop->getHeader() ||
-      trueSuccessor == loop->getLoopPreheader()) &&
-      !postDominatorTree_->dominates(trueSuccessor, root)) {
-    matched = true;
-    pred = std::make_pair(trueSuccessor, falseSuccessor);
-  }
-
-  // Get the most inner loop in which the false successor basic block is in.
-  loop = loopInfo_->getLoopFor(falseSuccessor);
-
-  // Check if exists a loop,
-  // the false branch successor is a loop header or a loop pre-header, and
-  // does not post dominate.
-  if (loop && (falseSuccessor == loop->getHeader() ||
-      falseSuccessor == loop->getLoopPreheader()) &&
-      !postDominatorTree_->dominates(falseSuccessor, root)) {
-    // If the heuristic matches both branches, predict none.
-    if (matched)
-      return empty;
-
-    matched = true;
-    pred = std::make_pair(falseSuccessor, trueSuccessor);
-  }
-
-  return (matched ? pred : empty);
+/// PredictEither - Successor 0 is predicted if taken0 holds, successor 1 if
+/// taken1 holds. If the heuristic matches both branches, predict none.
+int BranchHeuristicsInfo::predictEither(bool taken0, bool taken1) {
+    return taken0 == taken1 ? -1 : taken0 ? 0 : 1;
 }
 
-/// MatchGuardHeuristic - Predict that a comparison in which a register is
-/// an operand, the register is used before being defined in a successor
-/// block, and the successor block does not post-dominate will reach the
-/// successor block.
-/// @returns a Prediction that is a pair in which the first element is the
-/// successor taken, and the second the successor not taken.
-Prediction BranchHeuristicsInfo::matchGuardHeuristic(BasicBlock *root) const {
-  bool matched = false;
-  Prediction pred;
-
-  // Last instruction of basic block.
-  Instruction *TI = root->getTerminator();
-
-  // Basic block successors. True and False branches.
-  BasicBlock *trueSuccessor = TI->getSuccessor(0);
-  BasicBlock *falseSuccessor = TI->getSuccessor(1);
-
-  // Is the last instruction a Branch Instruction?
-  BranchInst *BI = dyn_cast<BranchInst>(TI);
-  if (!BI || !BI->isConditional())
-    return empty;
-
-  // Conditional instruction.
-  Value *cond = BI->getCondition();
-
-  // Find if the variable used in the branch instruction is
-  // in fact a comparison instruction.
-  CmpInst *CI = dyn_cast<CmpInst>(cond);
-  if (!CI)
-    return empty;
-
-  // Seek over all of the operands of this comparison instruction.
-  for (unsigned ops = 0; ops < CI->getNumOperands(); ++ops) {
-    // Find the operand.
-    Value *operand = CI->getOperand(ops);
-
-    // Check if the operand is a function argument or a value.
-    if (!isa<Argument>(operand) && !isa<User>(operand))
-      continue;
-
-    // Check if this variable was used in the true successor and
-    // does not post dominate.
-    // Since LLVM is in SSA form, it's impossible for a variable being used
-    // before being defined, so that statement is skipped.
-    if (operand->isUsedInBasicBlock(trueSuccessor) &&
-        !postDominatorTree_->dominates(trueSuccessor, root)) {
-      // If a heuristic was already matched, predict none and abort immediately.
-      if (matched)
-        return empty;
-
-      matched = true;
-      pred = std::make_pair(trueSuccessor, falseSuccessor);
+/// Predict - Evaluate the heuristic bh over the features of a branch.
+/// @returns the successor taken, 0 for the true branch and 1 for the false
+/// one, or -1 if the heuristic does not match.
+int BranchHeuristicsInfo::predict(BranchHeuristics bh, const BranchFeatures &f) const {
+    switch (bh) {
+    case LOOP_BRANCH_HEURISTIC:
+        // Predict as taken an edge back to a loop's head. Predict as not taken
+        // an edge exiting a loop.
+        return predictEither((f.backEdge[0] && f.loopHeader[0]) || f.exitEdge[1],
+                             (f.backEdge[1] && f.loopHeader[1]) || f.exitEdge[0]);
+    case POINTER_HEURISTIC:
+        // Predict that a comparison of a pointer against null or of two
+        // pointers will fail.
+        return f.pointerTaken;
+    case CALL_HEURISTIC:
+        // Predict a successor that contains a call and does not post-dominate
+        // will not be taken.
+        return predictEither(f.hasCall[1] && !f.postDominates[1], f.hasCall[0] && !f.postDominates[0]);
+    case OPCODE_HEURISTIC:
+        return f.opcodeTaken;
+    case LOOP_EXIT_HEURISTIC:
+        // Predict that a comparison in a loop in which no successor is a loop
+        // head will not exit the loop. Note that is not possible for both
+        // successors to be exit edges.
+        if (!f.inLoop || f.loopHeader[0] || f.loopHeader[1])
+            return -1;
+        return f.exitEdge[0] ? 1 : f.exitEdge[1] ? 0 : -1;
+    case RETURN_HEURISTIC:
+        // Predict a successor that contains a return will not be taken.
+        return predictEither(f.returns[1], f.returns[0]);
+    case STORE_HEURISTIC:
+        // Predict a successor that contains a store instruction and does not
+        // post-dominate will not be taken.
+        return predictEither(f.hasStore[1] && !f.postDominates[1], f.hasStore[0] && !f.postDominates[0]);
+    case LOOP_HEADER_HEURISTIC:
+        // Predict a successor that is a loop header or a loop pre-header and
+        // does not post-dominate will be taken.
+        return predictEither(f.loopEntry[0] && !f.postDominates[0], f.loopEntry[1] && !f.postDominates[1]);
+    case GUARD_HEURISTIC: {
+        // Predict that a comparison in which a register is an operand, the
+        // register is used before being defined in a successor block, and the
+        // successor block does not post-dominate will reach the successor
+        // block. More than one such use predicts none.
+        if (f.guardUses[0] + f.guardUses[1] != 1)
+            return -1;
+        return f.guardUses[0] ? 0 : 1;
     }
-
-    // Check if this variable was used in the false successor and
-    // does not post dominate.
-    if (operand->isUsedInBasicBlock(falseSuccessor) &&
-        !postDominatorTree_->dominates(falseSuccessor, root)) {
-      // If a heuristic was already matched, predict none and abort immediately.
-      if (matched)
-        return empty;
-
-      matched = true;
-      pred = std::make_pair(falseSuccessor, trueSuccessor);
+    default: // ERROR.
+        exit(1);
     }
-  }
-
-  return (matched ? pred : empty);
 }
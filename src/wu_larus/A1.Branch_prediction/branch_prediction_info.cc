@@ -7,9 +7,10 @@ class BranchPredictionInfo {
 public:
     typedef std::pair<const ::llvm::BasicBlock *, const ::llvm::BasicBlock *> Edge;
 private:
-    std::set<Edge> listBackEdges_, listExitEdges_;
-    std::map<const ::llvm::BasicBlock *, unsigned> backEdgesCount_;
-    std::set<const ::llvm::BasicBlock *> listCalls_, listStores_;
+    // Hashed, since they are looked up for every branch.
+    ::llvm::DenseSet<Edge> listBackEdges_, listExitEdges_;
+    ::llvm::DenseMap<const ::llvm::BasicBlock *, unsigned> backEdgesCount_;
+    ::llvm::DenseSet<const ::llvm::BasicBlock *> listCalls_, listStores_;
 
     ::llvm::DominatorTree *dominatorTree_;
     ::llvm::PostDominatorTree *postDominatorTree_;
@@ -28,6 +29,7 @@ public:
     bool isExitEdge(const Edge &edge) const;
     bool hasCall(const ::llvm::BasicBlock *BB) const;
     bool hasStore(const ::llvm::BasicBlock *BB) const;
+    size_t getMemoryUsage() const;
 
     inline ::llvm::DominatorTree *getDominatorTree() const { return dominatorTree_; }
     inline ::llvm::PostDominatorTree *getPostDominatorTree() const { return postDominatorTree_; }
@@ -48,8 +50,8 @@ BranchPredictionInfo::BranchPredictionInfo(DominatorTree *DT,
 /// FindBackAndExitEdges - Search for back and exit edges for all blocks
 /// within the function loops, calculated using loop information.
 void BranchPredictionInfo::findBackAndExitEdges(Function &F) {
-  std::set<const BasicBlock *> LoopsVisited;
-  std::set<const BasicBlock *> BlocksVisited;
+  SmallPtrSet<const BasicBlock *, 16> LoopsVisited;
+  SmallPtrSet<const BasicBlock *, 32> BlocksVisited;
 
   for (LoopInfo::iterator LIT = loopInfo_->begin(), LIE = loopInfo_->end(); LIT != LIE; ++LIT) {
     Loop *rootLoop = *LIT;
@@ -192,8 +194,7 @@ void BranchPredictionInfo::buildInfo(Function &F) {
 /// CountBackEdges - Given a basic block, count the number of successor
 /// that are back edges.
 unsigned BranchPredictionInfo::countBackEdges(BasicBlock *BB) const {
-  std::map<const BasicBlock *, unsigned>::const_iterator it =
-      backEdgesCount_.find(BB);
+  auto it = backEdgesCount_.find(BB);
   return it != backEdgesCount_.end() ? it->second : 0;
 }
 
@@ -222,3 +223,9 @@ bool BranchPredictionInfo::hasCall(const BasicBlock *BB) const {
 bool BranchPredictionInfo::hasStore(const BasicBlock *BB) const {
   return listStores_.count(BB);
 }
+
+/// getMemoryUsage - Bytes of heap held by the hashed sets.
+size_t BranchPredictionInfo::getMemoryUsage() const {
+  return listBackEdges_.getMemorySize() + listExitEdges_.getMemorySize() +
+         backEdgesCount_.getMemorySize() + listCalls_.getMemorySize() + listStores_.getMemorySize();
+}
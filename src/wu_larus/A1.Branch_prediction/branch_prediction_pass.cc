@@ -1,70 +1,157 @@
 #include "branch_prediction_info.cc"
 #include "branch_heuristics_info.cc"
 
+STATISTIC(NumPredictedBlocks, "Number of basic blocks whose successors were predicted");
+STATISTIC(NumPredictedEdges, "Number of successor edges predicted");
+STATISTIC(NumExitCallBranches, "Number of branches from blocks calling exit");
+STATISTIC(NumBackEdgeBranches, "Number of branches predicted by their back edges");
+STATISTIC(NumSwitchBranches, "Number of branches given equal probabilities, switches mostly");
+STATISTIC(NumLoopBranchMatches, "Number of branches matched by the loop branch heuristic");
+STATISTIC(NumPointerMatches, "Number of branches matched by the pointer heuristic");
+STATISTIC(NumCallMatches, "Number of branches matched by the call heuristic");
+STATISTIC(NumOpcodeMatches, "Number of branches matched by the opcode heuristic");
+STATISTIC(NumLoopExitMatches, "Number of branches matched by the loop exit heuristic");
+STATISTIC(NumReturnMatches, "Number of branches matched by the return heuristic");
+STATISTIC(NumStoreMatches, "Number of branches matched by the store heuristic");
+STATISTIC(NumLoopHeaderMatches, "Number of branches matched by the loop header heuristic");
+STATISTIC(NumGuardMatches, "Number of branches matched by the guard heuristic");
+
+STATISTIC(NumTripCountBranches, "Number of loop exit branches predicted from the trip count of their loop");
+
+static cl::opt<bool> trip_counts_opt(
+    "prediction-use-trip-counts",
+    cl::init(false),
+    cl::desc("Predict the exit branch of loops with a single exit from their constant or maximum trip count, "
+             "as found by ScalarEvolution, instead of the loop heuristics"));
+
+// Indexed by BranchHeuristics.
+static Statistic *const heuristic_matches[] = {
+    &NumLoopBranchMatches, &NumPointerMatches, &NumCallMatches, &NumOpcodeMatches, &NumLoopExitMatches,
+    &NumReturnMatches, &NumStoreMatches, &NumLoopHeaderMatches, &NumGuardMatches
+};
+
 struct BranchPredictionPass : PassInfoMixin<BranchPredictionPass> {
     typedef std::pair<const BasicBlock *, const BasicBlock *> Edge;
 
     static char ID;
 
-    BranchPredictionPass() : branchPredictionInfo_(nullptr), branchHeuristicsInfo_(nullptr) {}
-    ~BranchPredictionPass() { Clear(); }
-
     PreservedAnalyses run(Function &func, FunctionAnalysisManager &fam);
+    bool invalidate(Function &func, const PreservedAnalyses &pa, FunctionAnalysisManager::Invalidator &inv);
     void getAnalysisUsage(AnalysisUsage &au) const;
 
     double getEdgeProbability(const BasicBlock *src, const BasicBlock *dst) const;
     double getEdgeProbability(Edge &edge) const;
+    double getEdgeProbability(unsigned block, unsigned successor) const;
+    double getEdgeProbability(unsigned edge) const { return edgeProbabilities_[edge]; }
+    ArrayRef<double> getEdgeProbabilities() const { return edgeProbabilities_; }
+    unsigned getBlockNumber(const BasicBlock *BB) const;
+    unsigned getNumBlocks() const { return successorOffsets_.empty() ? 0 : successorOffsets_.size() - 1; }
     const BranchPredictionInfo *getInfo() const;
+    void restore(Function &func, ArrayRef<double> probabilities);
     void Clear();
+    size_t getMemoryUsage() const;
 
 private:
-    BranchPredictionInfo *branchPredictionInfo_;
-    BranchHeuristicsInfo *branchHeuristicsInfo_;
+    // Built in place, so that a function costs no allocation for them.
+    Optional<BranchPredictionInfo> branchPredictionInfo_;
+    Optional<BranchHeuristicsInfo> branchHeuristicsInfo_;
+
+    // Blocks are numbered once per function, in layout order. The probability of
+    // the s-th successor of block b lives at edgeProbabilities_[successorOffsets_[b] + s].
+    DenseMap<const BasicBlock *, unsigned> blockNumbers_;
+    std::vector<unsigned> successorOffsets_;
+    std::vector<double> edgeProbabilities_;
+
+    // With --prediction-use-trip-counts, the single exiting block of each loop
+    // whose trip count is known, with that loop and its trip count.
+    DenseMap<const BasicBlock *, std::pair<const Loop *, unsigned>> tripCounts_;
+
+    void numberBlocks(Function &func);
+    void findTripCounts(LoopInfo &LI, ScalarEvolution &SE);
+    void calculateBranchProbabilities(BasicBlock *BB, unsigned number);
+    static void addEdgeProbability(BranchHeuristics heuristic, unsigned taken, bool sameSuccessor,
+                                   double probabilities[2]);
+};
+
+/// BranchPredictionAnalysis - Algorithm 1 as a function analysis, so that its
+/// results are cached by the analysis manager along with the dominator and
+/// loop trees they were computed from.
+struct BranchPredictionAnalysis : AnalysisInfoMixin<BranchPredictionAnalysis> {
+    typedef BranchPredictionPass Result;
 
-    std::map<Edge, double> edgeProbabilities_;
+    Result run(Function &func, FunctionAnalysisManager &fam) {
+        Result result;
+        result.run(func, fam);
+        return result;
+    }
 
-    void calculateBranchProbabilities(BasicBlock *BB);
-    void addEdgeProbability(BranchHeuristics heuristic, const BasicBlock *root, Prediction pred);
+private:
+    friend AnalysisInfoMixin<BranchPredictionAnalysis>;
+    static AnalysisKey Key;
 };
 
+AnalysisKey BranchPredictionAnalysis::Key;
+
 PreservedAnalyses BranchPredictionPass::run(Function &func, FunctionAnalysisManager &fam) {
     // To perform the branch prediction, the following passes are required.
     DominatorTree *DT = &fam.getResult<DominatorTreeAnalysis>(func);
     PostDominatorTree *PDT = &fam.getResult<PostDominatorTreeAnalysis>(func);
     LoopInfo *LI =  &fam.getResult<LoopAnalysis>(func);
 
+    PredictionTimer timer {"BranchPrediction", "Branch prediction (A1)", &func};
+
     // Clear previously calculated data.
     Clear();
 
+    // Number the blocks and lay out one probability slot per successor.
+    numberBlocks(func);
+
     // Build all required information to run the branch prediction pass.
-    branchPredictionInfo_ = new BranchPredictionInfo(DT, LI, PDT);
+    branchPredictionInfo_.emplace(DT, LI, PDT);
     branchPredictionInfo_->buildInfo(func);
 
      // Create the class to check branch heuristics.
-    branchHeuristicsInfo_ = new BranchHeuristicsInfo(branchPredictionInfo_);
+    branchHeuristicsInfo_.emplace(branchPredictionInfo_.getPointer());
+
+    // Loops whose trip count is known are predicted from it.
+    if (trip_counts_opt)
+        findTripCounts(*LI, fam.getResult<ScalarEvolutionAnalysis>(func));
 
     // Run over all basic blocks of a function calculating branch probabilities.
     //for (Function::iterator FI = F.begin(), FE = F.end(); FI != FE; ++FI)
+    unsigned number = 0;
     for (auto &bb : func.getBasicBlockList())
         // Calculate the likelihood of the successors of this basic block.
-        calculateBranchProbabilities(&bb);
+        calculateBranchProbabilities(&bb, number++);
 
     // Delete unnecessary branch heuristic info.
-    delete branchHeuristicsInfo_;
-    branchHeuristicsInfo_ = NULL;
+    branchHeuristicsInfo_.reset();
 
     // Print.
-    // std::map<Edge, double> edgeProbabilities_;
 /*
     errs() << "[" << func.getName()<< "] Branch probabilities:\n";
-    for (auto prob : edgeProbabilities_) {
-        errs() <<
-            "(" << prob.first.first << ", " << prob.first.second << ") = " << prob.second << "\n";
+    for (auto &bb : func.getBasicBlockList()) {
+        for (unsigned s = 0; s < bb.getTerminator()->getNumSuccessors(); ++s)
+            errs() <<
+                "(" << &bb << ", " << bb.getTerminator()->getSuccessor(s) << ") = " <<
+                getEdgeProbability(getBlockNumber(&bb), s) << "\n";
     } errs() << "\n";
 */
     return PreservedAnalyses::all();;
 }
 
+/// invalidate - The probabilities depend on the instructions of the function,
+/// not only on its CFG, so they are kept only when explicitly preserved. They
+/// also go away with the dominator and loop trees that the info points to.
+bool BranchPredictionPass::invalidate(Function &func, const PreservedAnalyses &pa,
+                                      FunctionAnalysisManager::Invalidator &inv) {
+    auto checker = pa.getChecker<BranchPredictionAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>()) ||
+        inv.invalidate<DominatorTreeAnalysis>(func, pa) ||
+        inv.invalidate<PostDominatorTreeAnalysis>(func, pa) ||
+        inv.invalidate<LoopAnalysis>(func, pa);
+}
+
 /// getEdgeProbability - Find the edge probability based on the source and
 /// the destination basic block.  If the edge is not found, return 1.0
 /// (probability of 100% of being taken).
@@ -80,73 +167,170 @@ double BranchPredictionPass::getEdgeProbability(const BasicBlock *src,
 /// getEdgeProbability - Find the edge probability. If the edge is not found,
 /// return 1.0 (probability of 100% of being taken).
 double BranchPredictionPass::getEdgeProbability(Edge &edge) const {
-    // Search for the edge on the list.
-    std::map<Edge, double>::const_iterator I = edgeProbabilities_.find(edge);
+    // Search for the source block. Its successors are few, except for switches,
+    // so a linear scan for the destination is enough.
+    unsigned number = getBlockNumber(edge.first);
+    if (number != ~0U) {
+        const Instruction *TI = edge.first->getTerminator();
+        for (unsigned s = 0; s < TI->getNumSuccessors(); ++s)
+            if (TI->getSuccessor(s) == edge.second)
+                return edgeProbabilities_[successorOffsets_[number] + s];
+    }
+
+    // The edge was not found. Return the default value, meaning that there is
+    // no profile known for this edge. The default value is 1.0, meaning that
+    // the branch is taken with 100% likelihood.
+    return 1.0;
+}
+
+/// getEdgeProbability - Find the probability of the successor-th successor of
+/// the block numbered "block". This is a constant time lookup.
+double BranchPredictionPass::getEdgeProbability(unsigned block, unsigned successor) const {
+    return edgeProbabilities_[successorOffsets_[block] + successor];
+}
 
-    // If edge was found, return it. Otherwise return the default value,
-    // meaning that there is no profile known for this edge. The default value
-    // is 1.0, meaning that the branch is taken with 100% likelihood.
-    return I != edgeProbabilities_.end() ? I->second : 1.0;
+/// getBlockNumber - Get the number given to a basic block by numberBlocks, or
+/// ~0U if the block does not belong to the analysed function.
+unsigned BranchPredictionPass::getBlockNumber(const BasicBlock *BB) const {
+    auto I = blockNumbers_.find(BB);
+    return I != blockNumbers_.end() ? I->second : ~0U;
+}
+
+/// numberBlocks - Number the blocks of the function in layout order and
+/// reserve a probability slot for each successor of each block.
+void BranchPredictionPass::numberBlocks(Function &func) {
+    unsigned edges = 0;
+    blockNumbers_.reserve(func.size());
+    successorOffsets_.reserve(func.size() + 1);
+    for (auto &bb : func.getBasicBlockList()) {
+        blockNumbers_[&bb] = successorOffsets_.size();
+        successorOffsets_.push_back(edges);
+        edges += bb.getTerminator()->getNumSuccessors();
+    }
+    successorOffsets_.push_back(edges);
+
+    // Edges default to 1.0, as for edges not found.
+    edgeProbabilities_.assign(edges, 1.0);
 }
 
 /// getInfo - Get branch prediction information regarding edges and blocks.
 const BranchPredictionInfo *BranchPredictionPass::getInfo() const {
-    return branchPredictionInfo_;
+    return branchPredictionInfo_ ? branchPredictionInfo_.getPointer() : nullptr;
+}
+
+/// getMemoryUsage - Bytes of heap held by the result, info included.
+size_t BranchPredictionPass::getMemoryUsage() const {
+    return blockNumbers_.getMemorySize() + successorOffsets_.capacity() * sizeof(unsigned) +
+           edgeProbabilities_.capacity() * sizeof(double) + tripCounts_.getMemorySize() +
+           (branchPredictionInfo_ ? branchPredictionInfo_->getMemoryUsage() : 0);
+}
+
+/// restore - Take the probabilities of the successor slots of func from a
+/// previous run, instead of predicting them. No info is kept in that case.
+void BranchPredictionPass::restore(Function &func, ArrayRef<double> probabilities) {
+    Clear();
+    numberBlocks(func);
+    assert(probabilities.size() == edgeProbabilities_.size() && "Probability slots mismatch!");
+    std::copy(probabilities.begin(), probabilities.end(), edgeProbabilities_.begin());
 }
 
 /// Clear - Empty all stored information.
 void BranchPredictionPass::Clear() {
     // Clear edge probabilities.
+    blockNumbers_.clear();
+    successorOffsets_.clear();
     edgeProbabilities_.clear();
 
     // Free previously calculated branch prediction info class.
-    if (branchPredictionInfo_) {
-        delete branchPredictionInfo_;
-        branchPredictionInfo_ = NULL;
-    }
+    branchPredictionInfo_.reset();
 
     // Free previously calculated branch heuristics class.
-    if (branchHeuristicsInfo_) {
-        delete branchHeuristicsInfo_;
-        branchHeuristicsInfo_ = NULL;
+    branchHeuristicsInfo_.reset();
+
+    tripCounts_.clear();
+}
+
+/// findTripCounts - Find the loops with a single exiting block and a constant
+/// trip count, or else a constant maximum trip count. A block exiting nested
+/// loops is predicted from the innermost one.
+void BranchPredictionPass::findTripCounts(LoopInfo &LI, ScalarEvolution &SE) {
+    SmallVector<Loop *, 8> loops = LI.getLoopsInPreorder();
+    for (auto I = loops.rbegin(), E = loops.rend(); I != E; ++I) {
+        Loop *loop = *I;
+        BasicBlock *exiting = loop->getExitingBlock();
+        if (!exiting)
+            continue;
+
+        // A maximum close to the range of the induction variable only comes from
+        // its type, as for i < n, and tells nothing of the loop.
+        unsigned tripCount = SE.getSmallConstantTripCount(loop);
+        auto *maxTaken = dyn_cast<SCEVConstant>(SE.getConstantMaxBackedgeTakenCount(loop));
+        if (!tripCount && maxTaken &&
+            maxTaken->getAPInt().getActiveBits() + 2 <= maxTaken->getAPInt().getBitWidth())
+            tripCount = SE.getSmallConstantMaxTripCount(loop);
+        if (tripCount)
+            tripCounts_.try_emplace(exiting, loop, tripCount);
     }
 }
 
 /// CalculateBranchProbabilities - Implementation of the algorithm proposed
 /// by Wu (1994) to calculate the probabilities of all the successors of a
 /// basic block.
-void BranchPredictionPass::calculateBranchProbabilities(BasicBlock *BB) {
+void BranchPredictionPass::calculateBranchProbabilities(BasicBlock *BB, unsigned number) {
     // Obtain the last instruction.
     Instruction *TI = BB->getTerminator();
 
+    // Probability slots of the successors of this basic block.
+    double *probabilities = &edgeProbabilities_[successorOffsets_[number]];
+
     // Find the total number of successors (variable "m" in Wu's paper)
     unsigned successors = TI->getNumSuccessors();
 
     // Find the total number of back edges (variable "n" in Wu's paper)
     unsigned backedges = branchPredictionInfo_->countBackEdges(BB);
 
+    // The loop this block is the single exit of, and its trip count.
+    auto trip = tripCounts_.find(BB);
+
+    ++NumPredictedBlocks;
+    NumPredictedEdges += successors;
+
     // The basic block must have successors,
     // so that we can have something to profile
     if (successors != 0) {
         // If a block calls exit, then assume that every successor of this
         // basic block is never going to be reached.
         if (branchPredictionInfo_->callsExit(BB)) {
+            ++NumExitCallBranches;
             // According to the paper, successors that contains an exit call have a
             // probability of 0% to be taken.
+            for (unsigned s = 0; s < successors; ++s)
+                probabilities[s] = 0.0f;
+        } else if (trip != tripCounts_.end()) {
+            // The loop exits once every tripCount executions of its exiting block,
+            // so that its header runs tripCount times once frequencies are propagated.
+            ++NumTripCountBranches;
+            const Loop *loop = trip->second.first;
+            double exitProbability = 1.0 / trip->second.second;
+            unsigned exits = 0;
+            for (unsigned s = 0; s < successors; ++s)
+                exits += !loop->contains(TI->getSuccessor(s));
             for (unsigned s = 0; s < successors; ++s) {
-                BasicBlock *succ = TI->getSuccessor(s);
-                Edge edge = std::make_pair(BB, succ);
-                edgeProbabilities_[edge] = 0.0f;
+                if (loop->contains(TI->getSuccessor(s)))
+                    probabilities[s] = (1.0 - exitProbability) / (successors - exits);
+                else
+                    probabilities[s] = exitProbability / exits;
             }
         } else if (backedges > 0 && backedges < successors) {
             // Has some back edges, but not all.
+            ++NumBackEdgeBranches;
             for (unsigned s = 0; s < successors; ++s) {
                 BasicBlock *succ = TI->getSuccessor(s);
                 Edge edge = std::make_pair(BB, succ);
 
                 // Check if edge is a backedge.
                 if (branchPredictionInfo_->isBackEdge(edge)) {
-                    edgeProbabilities_[edge] =
+                    probabilities[s] =
                         branchHeuristicsInfo_->getProbabilityTaken(LOOP_BRANCH_HEURISTIC) / backedges;
                 } else {
                     // The other edge, the one that is not a back edge, is in most cases
@@ -154,7 +338,7 @@ void BranchPredictionPass::calculateBranchProbabilities(BasicBlock *BB) {
                     // an exit edge of an inner loop, but not for the outer loop. So,
                     // consider the other edges always as an exit edge.
 
-                    edgeProbabilities_[edge] =
+                    probabilities[s] =
                         branchHeuristicsInfo_->getProbabilityNotTaken(LOOP_BRANCH_HEURISTIC) /
                         (successors - backedges);
                 }
@@ -163,62 +347,55 @@ void BranchPredictionPass::calculateBranchProbabilities(BasicBlock *BB) {
             // This part handles the situation involving switch statements.
             // Every switch case has a equal likelihood to be taken.
             // Calculates the probability given the total amount of cases clauses.
-            for (unsigned s = 0; s < successors; ++s) {
-                BasicBlock *succ = TI->getSuccessor(s);
-                Edge edge = std::make_pair(BB, succ);
-                edgeProbabilities_[edge] = 1.0f / successors;
-            }
+            ++NumSwitchBranches;
+            for (unsigned s = 0; s < successors; ++s)
+                probabilities[s] = 1.0f / successors;
         } else {
             // Here we can only handle basic blocks with two successors (branches).
             // This assertion might never occur due to conditions meet above.
             assert(successors == 2 && "Expected a two way branch");
 
-            // Identify the two branch edges.
-            Edge trueEdge = std::make_pair(BB, TI->getSuccessor(0));
-            Edge falseEdge = std::make_pair(BB, TI->getSuccessor(1));
-
             // Initial branch probability. If no heuristic matches, than each edge
             // has a likelihood of 50% to be taken.
-            edgeProbabilities_[trueEdge] = 0.5f;
-            edgeProbabilities_[falseEdge] = 0.5f;
+            double branchProbabilities[2] = {0.5f, 0.5f};
+
+            // Gather what the heuristics look at once, then combine their
+            // predictions in place, and store the result once.
+            BranchFeatures features = branchHeuristicsInfo_->extractFeatures(BB);
+            bool sameSuccessor = TI->getSuccessor(0) == TI->getSuccessor(1);
 
             // Run over all heuristics implemented in BranchHeuristics class.
             for (unsigned h = 0; h < branchHeuristicsInfo_->getNumHeuristics(); ++h) {
                 // Retrieve the next heuristic.
                 BranchHeuristics heuristic = branchHeuristicsInfo_->getHeuristic(h);
 
-                // If the heuristic matched, add the edge probability to it.
-                Prediction pred = branchHeuristicsInfo_->matchHeuristic(heuristic, BB);
-
                 // Heuristic matched.
-                if (pred.first)
+                int taken = branchHeuristicsInfo_->predict(heuristic, features);
+                if (taken >= 0) {
+                    ++*heuristic_matches[heuristic];
                     // Recalculate edge probability.
-                    addEdgeProbability(heuristic, BB, pred);
+                    addEdgeProbability(heuristic, taken, sameSuccessor, branchProbabilities);
+                }
             }
 
+            probabilities[0] = branchProbabilities[0];
+            probabilities[1] = branchProbabilities[1];
         }
     }
 }
 
 /// addEdgeProbability - If a heuristic matches, calculates the edge probability
-/// combining previous predictions acquired.
-void BranchPredictionPass::addEdgeProbability(BranchHeuristics heuristic,
-                                              const BasicBlock *root,
-                                              Prediction pred) {
-    const BasicBlock *successorTaken = pred.first;
-    const BasicBlock *successorNotTaken = pred.second;
-
-    // Get the edges.
-    Edge edgeTaken = std::make_pair(root, successorTaken);
-    Edge edgeNotTaken = std::make_pair(root, successorNotTaken);
-
+/// combining previous predictions acquired. taken is the successor predicted
+/// as taken, 0 or 1, and probabilities those of both successors.
+void BranchPredictionPass::addEdgeProbability(BranchHeuristics heuristic, unsigned taken, bool sameSuccessor,
+                                              double probabilities[2]) {
     // The new probability of those edges.
-    double probTaken = branchHeuristicsInfo_->getProbabilityTaken(heuristic);
-    double probNotTaken = branchHeuristicsInfo_->getProbabilityNotTaken(heuristic);
+    double probTaken = BranchHeuristicsInfo::getProbabilityTaken(heuristic);
+    double probNotTaken = BranchHeuristicsInfo::getProbabilityNotTaken(heuristic);
 
     // The old probability of those edges.
-    double oldProbTaken    = getEdgeProbability(edgeTaken);
-    double oldProbNotTaken = getEdgeProbability(edgeNotTaken);
+    double oldProbTaken    = probabilities[taken];
+    double oldProbNotTaken = probabilities[1 - taken];
 
     // Combined the newly matched heuristic with the already given
     // probability of an edge. Uses the Dempster-Shafer theory to combine
@@ -226,8 +403,13 @@ void BranchPredictionPass::addEdgeProbability(BranchHeuristics heuristic,
     double d = oldProbTaken    * probTaken +
         oldProbNotTaken * probNotTaken;
 
-    edgeProbabilities_[edgeTaken] = oldProbTaken * probTaken / d;
-    edgeProbabilities_[edgeNotTaken] = oldProbNotTaken * probNotTaken / d;
+    probabilities[taken] = oldProbTaken * probTaken / d;
+    probabilities[1 - taken] = oldProbNotTaken * probNotTaken / d;
+
+    // Both successors are then the same edge, which keeps the probability
+    // given last, the one of the successor not taken.
+    if (sameSuccessor)
+        probabilities[taken] = probabilities[1 - taken];
 }
 
 /*
@@ -2,18 +2,75 @@
   This file is distributed under the University of Illinois Open Source
   License. See LICENSE for details.
 */
+#include "cfg_snapshot.cc"
+
+STATISTIC(NumPropagatedBlocks, "Number of basic blocks given a frequency");
+STATISTIC(NumPropagatedEdges, "Number of edges given a frequency");
+STATISTIC(NumCyclicProbabilityClamps, "Number of loops whose cyclic probability was limited below 1");
+STATISTIC(NumMarkovSweeps, "Number of sweeps of the markov solver over cyclic components");
+STATISTIC(NumMarkovDampedComponents, "Number of cyclic components the markov solver found no way out of");
+STATISTIC(NumMarkovUnconverged, "Number of cyclic components the markov solver stopped on before converging");
+
+static cl::opt<bool> loop_local_opt(
+    "prediction-loop-local",
+    cl::init(false),
+    cl::desc("Restrict the propagation from each loop header to the blocks of its loop and their exit edges"));
+
+static cl::opt<std::string> block_freq_solver_opt(
+    "prediction-block-freq-solver",
+    cl::init("propagate"),
+    cl::desc("How the block frequencies are found from the branch probabilities: propagate, along the loops "
+             "as Wu and Larus do, or markov, solving the function as a Markov chain, irreducible ones included"),
+    cl::value_desc("propagate|markov"));
+
+static cl::opt<double> markov_tolerance_opt(
+    "prediction-markov-tolerance",
+    cl::init(1e-9),
+    cl::desc("Largest relative change of a block frequency in the last sweep of the markov solver"),
+    cl::value_desc("tolerance"));
+
+static cl::opt<unsigned> markov_iterations_opt(
+    "prediction-markov-max-iterations",
+    cl::init(10000),
+    cl::desc("Most sweeps of the markov solver over each cyclic component of a function"),
+    cl::value_desc("N"));
+
+/// useMarkovSolver - Whether --prediction-block-freq-solver asks for the
+/// markov solver. Other values than the two known ones warn once.
+static bool useMarkovSolver() {
+    static const bool markov = []() {
+        if (block_freq_solver_opt == "markov")
+            return true;
+        if (block_freq_solver_opt != "propagate")
+            errs() << "WARNING! Invalid option --prediction-block-freq-solver=" << block_freq_solver_opt
+                   << " using 'propagate' instead.\n";
+        return false;
+    }();
+    return markov;
+}
+
 struct BlockEdgeFrequencyPass : PassInfoMixin<BlockEdgeFrequencyPass> {
     typedef std::pair<const BasicBlock *, const BasicBlock *> Edge;
 
     BlockEdgeFrequencyPass(BranchPredictionPass *bpp) : branchPredictionPass_{bpp} {}
+    // The frequencies are views of one array, which a copy would not follow.
+    BlockEdgeFrequencyPass(const BlockEdgeFrequencyPass &) = delete;
+    BlockEdgeFrequencyPass(BlockEdgeFrequencyPass &&) = default;
 
     PreservedAnalyses run(Function &func, FunctionAnalysisManager &fam);
+    bool invalidate(Function &func, const PreservedAnalyses &pa, FunctionAnalysisManager::Invalidator &inv);
 
     double getEdgeFrequency(const BasicBlock *src, const BasicBlock *dst) const;
     double getEdgeFrequency(Edge &edge) const;
+    double getEdgeFrequency(unsigned edge) const { return edgeFrequencies_[edge]; }
     double getBlockFrequency(const BasicBlock *BB) const;
-    double getBackEdgeProbabilities(Edge &edge);
-    void updateBlockFrequency(const BasicBlock *bb, double freq); // Multiply by containing function's frequency.
+    double getBlockFrequency(unsigned block) const { return blockFrequencies_[block]; }
+    double getBackEdgeProbabilities(unsigned edge) const;
+    double getLoopIterations(const Loop &loop) const;
+    const CFGSnapshot &getCFG() const { return cfg_; }
+    const BranchPredictionPass *getBranchPrediction() const { return branchPredictionPass_; }
+    void restore(Function &func, ArrayRef<double> blockFrequencies, ArrayRef<double> edgeFrequencies);
+    size_t getMemoryUsage() const;
 
 private:
     BlockEdgeFrequencyPass() {}
@@ -23,67 +80,162 @@ private:
     LoopInfo *loopInfo_;
     BranchPredictionPass *branchPredictionPass_;
 
-    std::set<const BasicBlock *> notVisited_;
-    std::set<const Loop *> loopsVisited_;
-    std::map<Edge, double> backEdgeProbabilities_;
-    std::map<Edge, double> edgeFrequencies_;
-    std::map<const BasicBlock *, double> blockFrequencies_;
-
-    void markReachable(BasicBlock *root);
+    // Blocks and edges are indexed by their ids in the snapshot.
+    CFGSnapshot cfg_;
+    BitVector notVisited_;
+    std::vector<unsigned> marked_;
+    SmallPtrSet<const Loop *, 8> loopsVisited_;
+    std::vector<double> backEdgeProbabilities_;
+    BitVector hasBackEdgeProbability_;
+    // The block frequencies, then the edge frequencies, in one allocation.
+    std::vector<double> frequencies_;
+    MutableArrayRef<double> blockFrequencies_;
+    MutableArrayRef<double> edgeFrequencies_;
+
+    // Scratch of the markov solver. The blocks of a region are solved
+    // together, and each of its strongly connected components becomes a
+    // region of its own in turn.
+    std::vector<unsigned> regions_;
+    std::vector<unsigned> components_;
+    std::vector<unsigned> dfsIndices_;
+    std::vector<unsigned> lowLinks_;
+    BitVector onStack_;
+    unsigned numComponents_;
+
+    void allocateFrequencies();
+    void markReachable(unsigned root, const Loop *loop = nullptr);
     void propagateLoop(const Loop *loop);
-    void propagateFreq(BasicBlock *head);
+    void propagateFreq(unsigned head);
+    void solveMarkov();
+    void solveRegion(unsigned region, unsigned head);
+    void sweepComponent(unsigned component, ArrayRef<unsigned> blocks, ArrayRef<double> inflow);
+    void findComponents(unsigned region, unsigned head, std::vector<unsigned> &blocks, std::vector<unsigned> &begins);
+};
+
+/// BlockEdgeFrequencyAnalysis - Algorithm 2 as a function analysis. The branch
+/// probabilities come from the cached result of algorithm 1.
+struct BlockEdgeFrequencyAnalysis : AnalysisInfoMixin<BlockEdgeFrequencyAnalysis> {
+    typedef BlockEdgeFrequencyPass Result;
+
+    Result run(Function &func, FunctionAnalysisManager &fam) {
+        Result result {&fam.getResult<BranchPredictionAnalysis>(func)};
+        result.run(func, fam);
+        return result;
+    }
+
+private:
+    friend AnalysisInfoMixin<BlockEdgeFrequencyAnalysis>;
+    static AnalysisKey Key;
 };
 
+AnalysisKey BlockEdgeFrequencyAnalysis::Key;
+
 
 const double BlockEdgeFrequencyPass::epsilon_ = 0.000001;
 
 PreservedAnalyses BlockEdgeFrequencyPass::run(Function &func, FunctionAnalysisManager &fam) {
     loopInfo_ = &fam.getResult<LoopAnalysis>(func);
-//    branchPredictionPass_ = &fam.getResult<BranchPredictionPass>(func);
+
+    PredictionTimer timer {"BlockEdgeFrequency", "Block and edge frequencies (A2)", &func};
+
+    // Take a snapshot of the control flow graph. Its block ids match the block
+    // numbers of the branch prediction pass.
+    cfg_.build(func, branchPredictionPass_->getInfo(), loopInfo_);
+    assert(cfg_.getNumBlocks() == branchPredictionPass_->getNumBlocks() && "Block numbering mismatch!");
+    NumPropagatedBlocks += cfg_.getNumBlocks();
+    NumPropagatedEdges += cfg_.getNumEdges();
 
     // Clear previously calculated data.
     notVisited_.clear();
+    notVisited_.resize(cfg_.getNumBlocks());
+    marked_.clear();
     loopsVisited_.clear();
-    backEdgeProbabilities_.clear();
-    edgeFrequencies_.clear();
-    blockFrequencies_.clear();
-
-    // Find all loop headers of this function.
-    BasicBlock *entry = nullptr;
-    for (auto &BB : func.getBasicBlockList()) {
-        if (entry == nullptr)
-            entry = &BB;
-        // If it is a loop head, add it to the list.
-        if (loopInfo_->isLoopHeader(&BB))
-            propagateLoop(loopInfo_->getLoopFor(&BB));
-    }
+    backEdgeProbabilities_.assign(cfg_.getNumEdges(), 0.0);
+    hasBackEdgeProbability_.clear();
+    hasBackEdgeProbability_.resize(cfg_.getNumEdges());
+    allocateFrequencies();
+
+    if (useMarkovSolver()) {
+        solveMarkov();
+    } else {
+        // Find all loop headers of this function.
+        for (unsigned BB = 0; BB < cfg_.getNumBlocks(); ++BB) {
+            // If it is a loop head, add it to the list.
+            if (cfg_.isLoopHeader(BB))
+                propagateLoop(loopInfo_->getLoopFor(cfg_.getBlock(BB)));
+        }
 
-    // Propagate frequencies assuming entry block is a loop head.
-    markReachable(entry);
-    propagateFreq(entry);
+        // Propagate frequencies assuming entry block is a loop head.
+        unsigned entry = 0;
+        markReachable(entry);
+        propagateFreq(entry);
+    }
 
-    // Clean up unnecessary information.
-    notVisited_.clear();
+    // Clean up unnecessary information. The result stays cached for the whole
+    // module, so the scratch gives its memory back.
+    notVisited_ = BitVector();
+    marked_.clear();
+    marked_.shrink_to_fit();
     loopsVisited_.clear();
     backEdgeProbabilities_.clear();
+    backEdgeProbabilities_.shrink_to_fit();
+    hasBackEdgeProbability_ = BitVector();
 
     // Print.
 /*
     errs() << "[" << func.getName()<< "] Edge frequencies:\n";
-    for (auto freq : edgeFrequencies_) {
-        errs() <<
-            "(" << freq.first.first << ", " << freq.first.second << ") = " << freq.second << "\n";
+    for (unsigned BB = 0; BB < cfg_.getNumBlocks(); ++BB) {
+        for (unsigned e = cfg_.succBegin(BB); e != cfg_.succEnd(BB); ++e)
+            errs() <<
+                "(" << cfg_.getBlock(BB) << ", " << cfg_.getBlock(cfg_.getSuccessor(e)) << ") = " <<
+                edgeFrequencies_[e] << "\n";
     } errs() << "\n";
-    // std::map<const BasicBlock *, double> blockFrequencies_;
     errs() << "[" << func.getName()<< "] Block frequencies:\n";
-    for (auto freq : blockFrequencies_) {
+    for (unsigned BB = 0; BB < cfg_.getNumBlocks(); ++BB) {
         errs() <<
-            "(" << freq.first << ") = " << freq.second << "\n";
+            "(" << cfg_.getBlock(BB) << ") = " << blockFrequencies_[BB] << "\n";
     } errs() << "\n";
 */
     return llvm::PreservedAnalyses::all();
 }
 
+/// invalidate - The frequencies go away with the branch probabilities they
+/// were propagated from, and with the loop tree.
+bool BlockEdgeFrequencyPass::invalidate(Function &func, const PreservedAnalyses &pa,
+                                        FunctionAnalysisManager::Invalidator &inv) {
+    auto checker = pa.getChecker<BlockEdgeFrequencyAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>()) ||
+        inv.invalidate<BranchPredictionAnalysis>(func, pa) ||
+        inv.invalidate<LoopAnalysis>(func, pa);
+}
+
+/// restore - Take the frequencies of func from a previous run, instead of
+/// propagating them. The snapshot is then taken without back edges and loops.
+void BlockEdgeFrequencyPass::restore(Function &func, ArrayRef<double> blockFrequencies,
+                                     ArrayRef<double> edgeFrequencies) {
+    loopInfo_ = nullptr;
+    cfg_.build(func, nullptr, nullptr);
+    assert(blockFrequencies.size() == cfg_.getNumBlocks() && edgeFrequencies.size() == cfg_.getNumEdges() &&
+           "Frequencies mismatch!");
+    allocateFrequencies();
+    std::copy(blockFrequencies.begin(), blockFrequencies.end(), blockFrequencies_.begin());
+    std::copy(edgeFrequencies.begin(), edgeFrequencies.end(), edgeFrequencies_.begin());
+}
+
+/// allocateFrequencies - Zero the frequencies of the blocks and edges of the
+/// snapshot, laid out in a single array.
+void BlockEdgeFrequencyPass::allocateFrequencies() {
+    frequencies_.assign(cfg_.getNumBlocks() + cfg_.getNumEdges(), 0.0);
+    frequencies_.shrink_to_fit();
+    blockFrequencies_ = MutableArrayRef<double>(frequencies_.data(), cfg_.getNumBlocks());
+    edgeFrequencies_ = MutableArrayRef<double>(frequencies_.data() + cfg_.getNumBlocks(), cfg_.getNumEdges());
+}
+
+/// getMemoryUsage - Bytes of heap held by the result, snapshot included.
+size_t BlockEdgeFrequencyPass::getMemoryUsage() const {
+    return cfg_.getMemoryUsage() + frequencies_.capacity() * sizeof(double);
+}
+
 /// getEdgeFrequency - Find the edge frequency based on the source and
 /// the destination basic block.  If the edge is not found, return a
 /// default value.
@@ -99,49 +251,78 @@ double BlockEdgeFrequencyPass::getEdgeFrequency(const BasicBlock *src,
 /// getEdgeFrequency - Find the edge frequency based on the edge. If the
 /// edge is not found, return a default value.
 double BlockEdgeFrequencyPass::getEdgeFrequency(Edge &edge) const {
-    // Search for the edge on the list.
-    std::map<Edge, double>::const_iterator I = edgeFrequencies_.find(edge);
-    return I != edgeFrequencies_.end() ? I->second : 0.0;
+    // Search for the edge among the successors of its source.
+    unsigned src = cfg_.getBlockId(edge.first);
+    unsigned dst = cfg_.getBlockId(edge.second);
+    if (src == ~0U || dst == ~0U)
+        return 0.0;
+    for (unsigned e = cfg_.succBegin(src); e != cfg_.succEnd(src); ++e)
+        if (cfg_.getSuccessor(e) == dst)
+            return edgeFrequencies_[e];
+    return 0.0;
 }
 
 /// getBlockFrequency - Find the basic block frequency based on the edge.
 /// If the basic block is not present, return a default value.
 double BlockEdgeFrequencyPass::getBlockFrequency(const BasicBlock *BB) const {
-    // Search for the block on the list.
-    std::map<const BasicBlock *, double>::const_iterator I =
-        blockFrequencies_.find(BB);
-    return I != blockFrequencies_.end() ? I->second : 0.0;
+    // Search for the block on the snapshot.
+    unsigned block = cfg_.getBlockId(BB);
+    return block != ~0U ? blockFrequencies_[block] : 0.0;
+}
+
+/// getLoopIterations - Average number of iterations of a loop each time it is
+/// entered: the 1 / (1 - cyclic probability) its header frequency is scaled by
+/// in propagateFreq. It is found as the frequency of the header over the sum
+/// of the frequencies of the edges entering the loop, so that it also holds
+/// for the markov solver and for restored frequencies. Unreachable loops have
+/// no iterations.
+double BlockEdgeFrequencyPass::getLoopIterations(const Loop &loop) const {
+    unsigned header = cfg_.getBlockId(loop.getHeader());
+    if (header == ~0U)
+        return 0.0;
+    double entering = 0.0;
+    for (unsigned p = cfg_.predBegin(header), pe = cfg_.predEnd(header); p != pe; ++p)
+        if (!loop.contains(cfg_.getBlock(cfg_.getPredecessor(p))))
+            entering += edgeFrequencies_[cfg_.getPredecessorEdge(p)];
+    return entering > 0.0 ? blockFrequencies_[header] / entering : 0.0;
 }
 
 /// getBackEdgeProbabilities - Get updated probability of back edge. In case
 /// of not found, get the edge probability from the branch prediction.
-double BlockEdgeFrequencyPass::getBackEdgeProbabilities(Edge &edge) {
+double BlockEdgeFrequencyPass::getBackEdgeProbabilities(unsigned edge) const {
     // Search for the back edge on the list. In case of not found, search on the
     // edge frequency list.
-    std::map<Edge, double>::const_iterator I = backEdgeProbabilities_.find(edge);
-    return I != backEdgeProbabilities_.end() ?
-        I->second : branchPredictionPass_->getEdgeProbability(edge);
+    if (hasBackEdgeProbability_.test(edge))
+        return backEdgeProbabilities_[edge];
+    return branchPredictionPass_->getEdgeProbability(edge);
 }
 
 /// MarkReachable - Mark all blocks reachable from root block as not visited.
-void BlockEdgeFrequencyPass::markReachable(BasicBlock *root) {
-    // Clear the list first.
-    notVisited_.clear();
+/// If a loop is given, only the blocks of that loop are marked.
+void BlockEdgeFrequencyPass::markReachable(unsigned root, const Loop *loop) {
+    // Clear the list first. Only the blocks marked by the previous call can be
+    // set, so this costs as much as that call did.
+    for (unsigned BB : marked_)
+        notVisited_.reset(BB);
+    marked_.clear();
 
     // Use an artificial stack.
-    SmallVector<BasicBlock *, 16> stack;
+    SmallVector<unsigned, 16> stack;
     stack.push_back(root);
 
     // Visit all childs marking them as visited in depth-first order.
     while (!stack.empty()) {
-        BasicBlock *BB = stack.pop_back_val();
-        if (! notVisited_.insert(BB).second)
+        unsigned BB = stack.pop_back_val();
+        if (notVisited_.test(BB))
             continue;
+        if (loop && !loop->contains(cfg_.getBlock(BB)))
+            continue;
+        notVisited_.set(BB);
+        marked_.push_back(BB);
 
         // Put the new successors into the stack.
-        Instruction *TI = BB->getTerminator();
-        for (unsigned s = 0; s < TI->getNumSuccessors(); ++s)
-            stack.push_back(TI->getSuccessor(s));
+        for (unsigned e = cfg_.succBegin(BB); e != cfg_.succEnd(BB); ++e)
+            stack.push_back(cfg_.getSuccessor(e));
     }
 }
 
@@ -160,29 +341,30 @@ void BlockEdgeFrequencyPass::propagateLoop(const Loop *loop) {
     }
 
     // Find the header.
-    BasicBlock *head = loop->getHeader();
-    // Mark as not visited all blocks reachable from the loop head.
-    markReachable(head);
+    unsigned head = cfg_.getBlockId(loop->getHeader());
+    // Mark as not visited all blocks reachable from the loop head. The blocks
+    // outside of the loop are recomputed by the enclosing loop anyway, so they
+    // may be left out. The exit edges still get their frequencies, as they are
+    // successors of blocks in the loop.
+    markReachable(head, loop_local_opt ? loop : nullptr);
     // Propagate frequencies from the loop head.
     propagateFreq(head);
 }
 
 /// PropagateFreq - Compute basic block and edge frequencies by propagating
 /// frequencies.
-void BlockEdgeFrequencyPass::propagateFreq(BasicBlock *head) {
-    const BranchPredictionInfo *info = branchPredictionPass_->getInfo();
-
+void BlockEdgeFrequencyPass::propagateFreq(unsigned head) {
     // Use an artificial stack to avoid recursive calls to PropagateFreq.
-    std::vector<BasicBlock *> stack;
+    std::vector<unsigned> stack;
     stack.push_back(head);
 
     do {
         // Get the current basic block.
-        BasicBlock *BB = stack.back();
+        unsigned BB = stack.back();
         stack.pop_back();
 
         // If BB has been visited.
-        if (!notVisited_.count(BB))
+        if (!notVisited_.test(BB))
             continue;
 
         // Define the block frequency. If it's a loop head, assume it executes only
@@ -196,11 +378,9 @@ void BlockEdgeFrequencyPass::propagateFreq(BasicBlock *head) {
             // We can't calculate the block frequency if there is a back edge still
             // not calculated.
             bool InvalidEdge = false;
-            for (pred_iterator PI = pred_begin(BB), PE = pred_end(BB);
-                 PI != PE; ++PI) {
-                BasicBlock *pred = *PI;
-                if (notVisited_.count(pred) &&
-                    !info->isBackEdge(std::make_pair(pred, BB))) {
+            for (unsigned p = cfg_.predBegin(BB), pe = cfg_.predEnd(BB); p != pe; ++p) {
+                if (notVisited_.test(cfg_.getPredecessor(p)) &&
+                    !cfg_.isBackEdge(cfg_.getPredecessorEdge(p))) {
                     InvalidEdge = true;
                     break;
                 }
@@ -216,15 +396,13 @@ void BlockEdgeFrequencyPass::propagateFreq(BasicBlock *head) {
             double cyclic_probability = 0.0;
 
             // Verify if BB is a loop head.
-            bool loop_head = loopInfo_->isLoopHeader(BB);
+            bool loop_head = cfg_.isLoopHeader(BB);
 
             // Calculate the block frequency and the cyclic_probability in case
             // of back edges using the sum of their predecessor's edge frequencies.
-            for (pred_iterator PI = pred_begin(BB), PE = pred_end(BB); PI != PE; ++PI) {
-                BasicBlock *pred = *PI;
-
-                Edge edge = std::make_pair(pred, BB);
-                if (info->isBackEdge(edge) && loop_head)
+            for (unsigned p = cfg_.predBegin(BB), pe = cfg_.predEnd(BB); p != pe; ++p) {
+                unsigned edge = cfg_.getPredecessorEdge(p);
+                if (cfg_.isBackEdge(edge) && loop_head)
                     cyclic_probability += getBackEdgeProbabilities(edge);
                 else
                     bfreq += edgeFrequencies_[edge];
@@ -232,56 +410,286 @@ void BlockEdgeFrequencyPass::propagateFreq(BasicBlock *head) {
 
             // For loops that seems not to terminate, the cyclic probability can be
             // higher than 1.0. In this case, limit the cyclic probability below 1.0.
-            if (cyclic_probability > (1.0 - epsilon_))
+            if (cyclic_probability > (1.0 - epsilon_)) {
                 cyclic_probability = 1.0 - epsilon_;
+                ++NumCyclicProbabilityClamps;
+            }
 
             // Calculate the block frequency.
             blockFrequencies_[BB] = bfreq / (1.0 - cyclic_probability);
         }
 
         // Mark the block as visited.
-        notVisited_.erase(BB);
+        notVisited_.reset(BB);
 
         // Calculate the edges frequencies for all successor of this block.
-        Instruction *TI = BB->getTerminator();
-        for (unsigned s = 0; s < TI->getNumSuccessors(); ++s) {
-            BasicBlock *successor = TI->getSuccessor(s);
-            Edge edge = std::make_pair(BB, successor);
-            double prob = branchPredictionPass_->getEdgeProbability(edge);
+        for (unsigned e = cfg_.succBegin(BB), ee = cfg_.succEnd(BB); e != ee; ++e) {
+            double prob = branchPredictionPass_->getEdgeProbability(BB, e - cfg_.succBegin(BB));
 
             // The edge frequency is the probability of this edge times the block
             // frequency.
             double efreq = prob * blockFrequencies_[BB];
-            edgeFrequencies_[edge] = efreq;
+            edgeFrequencies_[e] = efreq;
 
             // If a successor is the loop head, update back edge probability.
-            if (successor == head)
-                backEdgeProbabilities_[edge] = efreq;
-
+            if (cfg_.getSuccessor(e) == head) {
+                backEdgeProbabilities_[e] = efreq;
+                hasBackEdgeProbability_.set(e);
+            }
         }
 
         // Propagate frequencies for all successor that are not back edges.
-        SmallVector<BasicBlock *, 64> backedges;
-        for (unsigned s = 0; s < TI->getNumSuccessors(); ++s) {
-            BasicBlock *successor = TI->getSuccessor(s);
-            Edge edge = std::make_pair(BB, successor);
-            if (!info->isBackEdge(edge))
-                backedges.push_back(successor);
-        }
-
         // This was done just to ensure that the algorithm would process the
         // left-most child before, to simulate normal PropagateFreq recursive calls.
-        SmallVector<BasicBlock *, 64>::reverse_iterator RI, RE;
-        for (RI = backedges.rbegin(), RE = backedges.rend(); RI != RE; ++RI)
-            stack.push_back(*RI);
+        for (unsigned e = cfg_.succEnd(BB), eb = cfg_.succBegin(BB); e != eb; --e)
+            if (!cfg_.isBackEdge(e - 1))
+                stack.push_back(cfg_.getSuccessor(e - 1));
     } while (!stack.empty());
 }
 
-void BlockEdgeFrequencyPass::updateBlockFrequency(const BasicBlock *bb, double freq) {
-//    assert((blockFrequencies_.find(bb) != blockFrequencies_.end()) && "BasicBlock not found!");
-    if (!bb || !freq) return;
-    if (blockFrequencies_.find(bb) != blockFrequencies_.end())
-        blockFrequencies_[bb] *= freq;
+/// SolveMarkov - Compute the block frequencies as the expected number of
+/// visits of each block, seeing the function as a Markov chain whose states
+/// are the blocks and whose transitions are the branch probabilities:
+///
+///   freq(b) = [b is the entry] + sum over edges p->b of prob(p->b) * freq(p)
+///
+/// The system is solved over the strongly connected components of the
+/// control flow graph, in topological order, so that the frequency flowing
+/// into a component is known. Components entered through a single block are
+/// solved as propagateLoop does, for one visit of that block first, then
+/// scaled by its cyclic probability. Components entered through several
+/// blocks, which come from irreducible control flow, are swept with
+/// Gauss-Seidel until no frequency changes by more than the tolerance, or
+/// the iteration cap is hit.
+void BlockEdgeFrequencyPass::solveMarkov() {
+    // The whole function is the first region, and components are numbered
+    // from 1 on, as they become the regions of their blocks.
+    regions_.assign(cfg_.getNumBlocks(), 0);
+    components_.assign(cfg_.getNumBlocks(), ~0U);
+    dfsIndices_.assign(cfg_.getNumBlocks(), ~0U);
+    lowLinks_.resize(cfg_.getNumBlocks());
+    onStack_.resize(cfg_.getNumBlocks());
+    numComponents_ = 1;
+
+    unsigned entry = 0;
+    solveRegion(0, entry);
+
+    // The edge frequency is the probability of this edge times the block
+    // frequency.
+    for (unsigned BB = 0; BB < cfg_.getNumBlocks(); ++BB)
+        for (unsigned e = cfg_.succBegin(BB), ee = cfg_.succEnd(BB); e != ee; ++e)
+            edgeFrequencies_[e] = branchPredictionPass_->getEdgeProbability(e) * blockFrequencies_[BB];
+
+    regions_.clear();
+    regions_.shrink_to_fit();
+    components_.clear();
+    components_.shrink_to_fit();
+    dfsIndices_.clear();
+    dfsIndices_.shrink_to_fit();
+    lowLinks_.clear();
+    lowLinks_.shrink_to_fit();
+    onStack_.clear();
+}
+
+/// SolveRegion - Compute the frequencies of the blocks of the region for one
+/// visit of its head, the edges reaching the head being left out.
+void BlockEdgeFrequencyPass::solveRegion(unsigned region, unsigned head) {
+    std::vector<unsigned> blocks, begins;
+    findComponents(region, head, blocks, begins);
+
+    std::vector<double> inflow;
+    for (unsigned c = 0; c + 1 < begins.size(); ++c) {
+        unsigned first = begins[c], last = begins[c + 1];
+        unsigned component = components_[blocks[first]];
+
+        // The frequency flowing into each block from the previous components,
+        // which is final, and the blocks it flows into.
+        inflow.assign(last - first, 0.0);
+        bool cyclic = last - first > 1;
+        unsigned entries = 0, entry = 0;
+        for (unsigned i = first; i < last; ++i) {
+            unsigned BB = blocks[i];
+            bool entered = BB == head;
+            inflow[i - first] = BB == head ? 1.0 : 0.0;
+            for (unsigned p = cfg_.predBegin(BB), pe = cfg_.predEnd(BB); p != pe && BB != head; ++p) {
+                unsigned pred = cfg_.getPredecessor(p);
+                // Blocks unreachable from the entry were never given a component.
+                if (regions_[pred] != region || components_[pred] == ~0U)
+                    continue;
+                if (components_[pred] == component) {
+                    cyclic = true;
+                    continue;
+                }
+                inflow[i - first] += branchPredictionPass_->getEdgeProbability(cfg_.getPredecessorEdge(p)) *
+                    blockFrequencies_[pred];
+                entered = true;
+            }
+            if (entered) {
+                ++entries;
+                entry = i;
+            }
+            blockFrequencies_[BB] = inflow[i - first];
+        }
+        if (!cyclic)
+            continue;
+
+        if (entries > 1) {
+            sweepComponent(component, makeArrayRef(blocks).slice(first, last - first), inflow);
+            continue;
+        }
+
+        // A loop, whose entry is its header. Solve its body for one visit of
+        // the header, then find how many visits the back edges add.
+        for (unsigned i = first; i < last; ++i)
+            regions_[blocks[i]] = component;
+        solveRegion(component, blocks[entry]);
+
+        double cyclic_probability = 0.0;
+        for (unsigned p = cfg_.predBegin(blocks[entry]), pe = cfg_.predEnd(blocks[entry]); p != pe; ++p)
+            if (regions_[cfg_.getPredecessor(p)] == component)
+                cyclic_probability += branchPredictionPass_->getEdgeProbability(cfg_.getPredecessorEdge(p)) *
+                    blockFrequencies_[cfg_.getPredecessor(p)];
+
+        // For loops that seems not to terminate, the cyclic probability can be
+        // higher than 1.0. In this case, limit the cyclic probability below 1.0.
+        if (cyclic_probability > (1.0 - epsilon_)) {
+            cyclic_probability = 1.0 - epsilon_;
+            ++NumCyclicProbabilityClamps;
+        }
+
+        double scale = inflow[entry - first] / (1.0 - cyclic_probability);
+        for (unsigned i = first; i < last; ++i) {
+            blockFrequencies_[blocks[i]] *= scale;
+            regions_[blocks[i]] = region;
+            components_[blocks[i]] = component;
+        }
+    }
+}
+
+/// SweepComponent - Solve a component entered through several blocks with
+/// Gauss-Seidel sweeps, given the frequency flowing into each of its blocks.
+void BlockEdgeFrequencyPass::sweepComponent(unsigned component, ArrayRef<unsigned> blocks,
+                                            ArrayRef<double> inflow) {
+    // For components that seem not to terminate, the visits would never end.
+    // As propagateFreq limits the cyclic probability, scale the probabilities
+    // inside of the component below 1.0.
+    bool leaves = false;
+    for (unsigned BB : blocks)
+        for (unsigned e = cfg_.succBegin(BB), ee = cfg_.succEnd(BB); e != ee; ++e)
+            if (components_[cfg_.getSuccessor(e)] != component && branchPredictionPass_->getEdgeProbability(e) > 0.0)
+                leaves = true;
+    double damping = 1.0;
+    if (!leaves) {
+        damping = 1.0 - epsilon_;
+        ++NumMarkovDampedComponents;
+    }
+
+    unsigned sweep = 0;
+    for (double change = std::numeric_limits<double>::infinity(); change > markov_tolerance_opt; ++sweep) {
+        if (sweep == markov_iterations_opt) {
+            ++NumMarkovUnconverged;
+            break;
+        }
+        change = 0.0;
+        for (unsigned i = 0; i < blocks.size(); ++i) {
+            unsigned BB = blocks[i];
+            // Self loops are solved in closed form.
+            double bfreq = inflow[i];
+            double self_probability = 0.0;
+            for (unsigned p = cfg_.predBegin(BB), pe = cfg_.predEnd(BB); p != pe; ++p) {
+                unsigned pred = cfg_.getPredecessor(p);
+                if (components_[pred] != component)
+                    continue;
+                double prob = damping * branchPredictionPass_->getEdgeProbability(cfg_.getPredecessorEdge(p));
+                if (pred == BB)
+                    self_probability += prob;
+                else
+                    bfreq += prob * blockFrequencies_[pred];
+            }
+            bfreq /= std::max(1.0 - self_probability, epsilon_);
+
+            if (bfreq > 0.0)
+                change = std::max(change, std::abs(bfreq - blockFrequencies_[BB]) / bfreq);
+            blockFrequencies_[BB] = bfreq;
+        }
+    }
+    NumMarkovSweeps += sweep;
+}
+
+/// FindComponents - Find the strongly connected components of the blocks of
+/// the region reachable from its head, with Tarjan's algorithm on an
+/// artificial stack, the edges reaching the head being left out. Each
+/// component gets a new number. The blocks of the c-th component are stored
+/// from begins[c] to begins[c + 1], in the order they were reached, and the
+/// components in topological order, the head first.
+void BlockEdgeFrequencyPass::findComponents(unsigned region, unsigned head, std::vector<unsigned> &blocks,
+                                            std::vector<unsigned> &begins) {
+    const unsigned unvisited = ~0U;
+    std::vector<unsigned> stack;
+    // The block being visited, and the next of its successor edges.
+    std::vector<std::pair<unsigned, unsigned>> path;
+
+    // Components are found in reverse topological order, and reversed last.
+    std::vector<unsigned> ends;
+    blocks.clear();
+    unsigned next = 0;
+    auto visit = [&](unsigned BB) {
+        dfsIndices_[BB] = lowLinks_[BB] = next++;
+        stack.push_back(BB);
+        onStack_.set(BB);
+        path.push_back(std::make_pair(BB, cfg_.succBegin(BB)));
+    };
+
+    visit(head);
+    while (!path.empty()) {
+        unsigned BB = path.back().first;
+        if (path.back().second != cfg_.succEnd(BB)) {
+            unsigned successor = cfg_.getSuccessor(path.back().second++);
+            if (successor == head || regions_[successor] != region)
+                continue;
+            if (dfsIndices_[successor] == unvisited)
+                visit(successor);
+            else if (onStack_.test(successor))
+                lowLinks_[BB] = std::min(lowLinks_[BB], dfsIndices_[successor]);
+            continue;
+        }
+
+        // All successors are done.
+        path.pop_back();
+        if (!path.empty())
+            lowLinks_[path.back().first] = std::min(lowLinks_[path.back().first], lowLinks_[BB]);
+        if (lowLinks_[BB] != dfsIndices_[BB])
+            continue;
+
+        // BB is the first block reached of its component, which is the top of
+        // the stack down to BB.
+        size_t first = blocks.size();
+        unsigned member;
+        do {
+            member = stack.back();
+            stack.pop_back();
+            onStack_.reset(member);
+            components_[member] = numComponents_;
+            blocks.push_back(member);
+        } while (member != BB);
+        ++numComponents_;
+        std::reverse(blocks.begin() + first, blocks.end());
+        ends.push_back(blocks.size());
+    }
+
+    // Reverse the order of the components, keeping the order of their blocks,
+    // and leave the blocks unvisited for the next search.
+    std::vector<unsigned> ordered;
+    ordered.reserve(blocks.size());
+    begins.clear();
+    for (size_t c = ends.size(); c-- > 0;) {
+        begins.push_back(ordered.size());
+        ordered.insert(ordered.end(), blocks.begin() + (c ? ends[c - 1] : 0), blocks.begin() + ends[c]);
+    }
+    begins.push_back(ordered.size());
+    blocks.swap(ordered);
+    for (unsigned BB : blocks)
+        dfsIndices_[BB] = unvisited;
 }
 
 /*
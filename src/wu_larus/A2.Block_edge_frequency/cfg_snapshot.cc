@@ -0,0 +1,132 @@
+/*
+  This file is distributed under the University of Illinois Open Source
+  License. See LICENSE for details.
+*/
+
+/// CFGSnapshot - A compact, read-only copy of the control flow graph of a
+/// function, in compressed sparse row form. Blocks get dense ids in layout
+/// order, and the successor edges of block b are the ids
+/// [succBegin(b), succEnd(b)), the same numbering used for the probability
+/// slots of BranchPredictionPass. The predecessor list of each block refers
+/// back to those successor edges, and keeps the order of pred_begin/pred_end.
+class CFGSnapshot {
+public:
+    void build(Function &func, const BranchPredictionInfo *info, const LoopInfo *loopInfo);
+    void clear();
+
+    inline unsigned getNumBlocks() const { return blocks_.size(); }
+    inline unsigned getNumEdges() const { return numEdges_; }
+    inline const BasicBlock *getBlock(unsigned block) const { return blocks_[block]; }
+    unsigned getBlockId(const BasicBlock *BB) const;
+
+    inline unsigned succBegin(unsigned block) const { return storage_[block]; }
+    inline unsigned succEnd(unsigned block) const { return storage_[block + 1]; }
+    inline unsigned getSuccessor(unsigned edge) const { return storage_[successorsBase_ + edge]; }
+
+    inline unsigned predBegin(unsigned block) const { return storage_[predOffsetsBase_ + block]; }
+    inline unsigned predEnd(unsigned block) const { return storage_[predOffsetsBase_ + block + 1]; }
+    inline unsigned getPredecessor(unsigned pred) const { return storage_[predecessorsBase_ + 2 * pred]; }
+    inline unsigned getPredecessorEdge(unsigned pred) const { return storage_[predecessorsBase_ + 2 * pred + 1]; }
+
+    inline bool isBackEdge(unsigned edge) const { return backEdges_.test(edge); }
+    inline bool isLoopHeader(unsigned block) const { return loopHeaders_.test(block); }
+
+    size_t getMemoryUsage() const;
+
+private:
+    std::vector<const BasicBlock *> blocks_;
+    DenseMap<const BasicBlock *, unsigned> blockIds_;
+
+    // The successor and predecessor lists share one array: the successor
+    // offsets of the blocks, then the successors, the predecessor offsets,
+    // and the predecessor block and edge of each predecessor, interleaved.
+    std::vector<unsigned> storage_;
+    unsigned numEdges_ = 0;
+    unsigned successorsBase_ = 0, predOffsetsBase_ = 0, predecessorsBase_ = 0;
+
+    BitVector backEdges_;
+    BitVector loopHeaders_;
+};
+
+/// Build - Take the snapshot of the function F. Without info and loopInfo,
+/// no edge is marked as a back edge and no block as a loop header.
+void CFGSnapshot::build(Function &F, const BranchPredictionInfo *info, const LoopInfo *loopInfo) {
+    clear();
+
+    // Number the blocks, and count the edges to size the lists at once.
+    unsigned numPreds = 0;
+    blocks_.reserve(F.size());
+    blockIds_.reserve(F.size());
+    for (const BasicBlock &BB : F) {
+        blockIds_[&BB] = blocks_.size();
+        blocks_.push_back(&BB);
+        numEdges_ += BB.getTerminator()->getNumSuccessors();
+        numPreds += std::distance(pred_begin(&BB), pred_end(&BB));
+    }
+    unsigned numBlocks = blocks_.size();
+    successorsBase_ = numBlocks + 1;
+    predOffsetsBase_ = successorsBase_ + numEdges_;
+    predecessorsBase_ = predOffsetsBase_ + numBlocks + 1;
+    storage_.resize(predecessorsBase_ + 2 * numPreds);
+
+    // Successor edges. The first edge from a block to each of its successors
+    // is recorded, so that predecessors can find their edge in constant time.
+    DenseMap<std::pair<unsigned, unsigned>, unsigned> firstEdge;
+    loopHeaders_.resize(numBlocks);
+    unsigned edge = 0;
+    for (unsigned b = 0; b < numBlocks; ++b) {
+        const BasicBlock *BB = blocks_[b];
+        storage_[b] = edge;
+        if (loopInfo && loopInfo->isLoopHeader(BB))
+            loopHeaders_.set(b);
+
+        const Instruction *TI = BB->getTerminator();
+        for (unsigned s = 0; s < TI->getNumSuccessors(); ++s, ++edge) {
+            unsigned successor = blockIds_[TI->getSuccessor(s)];
+            firstEdge.insert(std::make_pair(std::make_pair(b, successor), edge));
+            storage_[successorsBase_ + edge] = successor;
+        }
+    }
+    storage_[numBlocks] = edge;
+
+    backEdges_.resize(numEdges_);
+    for (unsigned b = 0; b < numBlocks; ++b)
+        for (unsigned e = succBegin(b); e != succEnd(b); ++e)
+            if (info && info->isBackEdge(std::make_pair(blocks_[b], blocks_[getSuccessor(e)])))
+                backEdges_.set(e);
+
+    // Predecessor lists, in the order given by pred_begin/pred_end.
+    unsigned pred = 0;
+    for (unsigned b = 0; b < numBlocks; ++b) {
+        storage_[predOffsetsBase_ + b] = pred;
+        for (const_pred_iterator PI = pred_begin(blocks_[b]), PE = pred_end(blocks_[b]); PI != PE; ++PI, ++pred) {
+            unsigned predecessor = blockIds_[*PI];
+            storage_[predecessorsBase_ + 2 * pred] = predecessor;
+            storage_[predecessorsBase_ + 2 * pred + 1] = firstEdge[std::make_pair(predecessor, b)];
+        }
+    }
+    storage_[predOffsetsBase_ + numBlocks] = pred;
+}
+
+/// Clear - Empty the snapshot.
+void CFGSnapshot::clear() {
+    blocks_.clear();
+    blockIds_.clear();
+    storage_.clear();
+    numEdges_ = successorsBase_ = predOffsetsBase_ = predecessorsBase_ = 0;
+    backEdges_.clear();
+    loopHeaders_.clear();
+}
+
+/// getMemoryUsage - Bytes of heap held by the snapshot.
+size_t CFGSnapshot::getMemoryUsage() const {
+    return blocks_.capacity() * sizeof(const BasicBlock *) + blockIds_.getMemorySize() +
+           storage_.capacity() * sizeof(unsigned) + backEdges_.getMemorySize() + loopHeaders_.getMemorySize();
+}
+
+/// getBlockId - Get the id of a basic block, or ~0U if the block is not part
+/// of the snapshot.
+unsigned CFGSnapshot::getBlockId(const BasicBlock *BB) const {
+    auto I = blockIds_.find(BB);
+    return I != blockIds_.end() ? I->second : ~0U;
+}
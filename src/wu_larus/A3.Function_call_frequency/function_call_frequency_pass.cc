@@ -4,34 +4,159 @@
  todas as invocacoes de <F>.
  Que eh o produto da <FREQUENCIA DE CHAMADA LOCAL> vezes a <FREQUENCIA GLOBAL DE INVOCACAO> de <F>.
 */
+STATISTIC(NumCallEdges, "Number of call graph edges, one per caller and callee");
+STATISTIC(NumIndirectCallsResolved, "Number of indirect call sites split among their possible callees");
+STATISTIC(NumIndirectCallsSkipped, "Number of call sites skipped for having no known callee");
+STATISTIC(NumRecursionClamps, "Number of functions whose cyclic call probability was limited below 1");
+
+static cl::opt<bool> indirect_calls_opt(
+    "prediction-indirect-calls",
+    cl::init(true),
+    cl::desc("Split the frequency of indirect calls among their possible callees: the functions of their "
+             "!callees metadata, or else the address-taken functions of the same type"));
+
+static cl::list<std::string> roots_opt(
+    "prediction-root",
+    cl::CommaSeparated,
+    cl::desc("Entry functions of the call graph, instead of main, each called weight times (default 1) "
+             "from a virtual root"),
+    cl::value_desc("name[:weight],..."));
+
+static cl::opt<std::string> roots_file_opt(
+    "prediction-roots-file",
+    cl::desc("Read more entry functions from a file, as name[:weight], one per line, # starting comment lines"),
+    cl::value_desc("filename"));
+
+static cl::opt<bool> library_opt(
+    "prediction-library",
+    cl::init(false),
+    cl::desc("Take every externally visible function as an entry of the call graph, called once, as for a "
+             "library, given roots keeping their weights. Modules without main nor given roots always are"));
+
+/// CallNode - A function of the call graph, as seen by scc_iterator. The root
+/// calls every function, so that a single search finds all the SCCs.
+struct CallNode {
+    ArrayRef<unsigned> callees; // Numbers of the called functions.
+    const CallNode *nodes;      // All the nodes, by function number.
+
+    struct At {
+        const CallNode *nodes;
+        const CallNode *operator()(unsigned f) const { return nodes + f; }
+    };
+};
+
+namespace llvm {
+template <> struct GraphTraits<const CallNode *> {
+    typedef const CallNode *NodeRef;
+    typedef mapped_iterator<const unsigned *, CallNode::At> ChildIteratorType;
+
+    static NodeRef getEntryNode(NodeRef node) { return node; }
+    static ChildIteratorType child_begin(NodeRef node) {
+        return ChildIteratorType(node->callees.begin(), CallNode::At {node->nodes});
+    }
+    static ChildIteratorType child_end(NodeRef node) {
+        return ChildIteratorType(node->callees.end(), CallNode::At {node->nodes});
+    }
+};
+} // namespace llvm
+
 struct FunctionCallFrequencyPass {
     typedef std::pair<const Function*, const Function*> Edge;
 
-    FunctionCallFrequencyPass(
-        map<Function *, BranchPredictionPass *> *function_branch_prediction_results,
-        map<Function *, BlockEdgeFrequencyPass *> *function_block_edge_frequency_results
-    ) :
-        function_branch_prediction_results_(function_branch_prediction_results),
-        function_block_edge_frequency_results_(function_block_edge_frequency_results)
-    { }
+    // The results of algorithm 2 are only read during run, and never modified.
+    PreservedAnalyses run(Module &, const DenseMap<Function *, BlockEdgeFrequencyPass *> &function_block_edge_frequency_results);
+    bool invalidate(Module &module, const PreservedAnalyses &pa, ModuleAnalysisManager::Invalidator &inv);
+
+    double getCallFrequency(const Function *f) const;
+    double getGlobalCallFrequency(const Function *caller, const Function *callee) const;
+    double getGlobalBlockFrequency(const BlockEdgeFrequencyPass &local, const BasicBlock *bb) const;
+    double getFrequencyScale(const Function *f) const;
 
-    PreservedAnalyses run(Module &);
+    // Building the call graph one function at a time, as run does, for callers
+    // that release each function once done: the functions with a body are
+    // added in module order, then the call frequencies are propagated.
+    void startCalls(Module &module);
+    void addCalls(Function &func, const BlockEdgeFrequencyPass &local);
+    PreservedAnalyses finishCalls();
+
+    // The call graph. Functions are numbered in module order, and the calls of
+    // function f, one per callee, are [callsBegin(f), callsEnd(f)).
+    unsigned getNumFunctions() const { return functions_.size(); }
+    const Function *getFunction(unsigned f) const { return functions_[f]; }
+    unsigned getFunctionId(const Function *f) const;
+    unsigned getNumCalls() const { return callees_.size(); }
+    unsigned callsBegin(unsigned f) const { return callee_offsets_[f]; }
+    unsigned callsEnd(unsigned f) const { return callee_offsets_[f + 1]; }
+    unsigned getCallee(unsigned call) const { return callees_[call]; }
+    double getGlobalCallFrequency(unsigned call) const { return gfreqs_[call]; }
+
+private:
+    void index_callers();
+    void mark_address_taken(const Value *value, SmallPtrSetImpl<const Constant *> &visited);
+    bool find_listed_callees(const CallBase &call, SmallVectorImpl<const Function *> &callees);
+    void add_indirect_calls();
+    void find_roots(Module &module);
+    void find_back_edges(const vector<unsigned> &scc, vector<unsigned> &order, vector<unsigned> &heads);
+    void propagate_loop(const vector<unsigned> &order, unsigned head);
+    void propagate_call_freq(const vector<unsigned> &order);
+
+    // Call graph in compressed sparse row form. Functions are numbered in module
+    // order, the calls of function f are the edges [callee_offsets_[f], callee_offsets_[f + 1]),
+    // and the edges calling f are caller_edges_[caller_offsets_[f]] ... caller_edges_[caller_offsets_[f + 1] - 1].
+    vector<Function *> functions_;
+    DenseMap<const Function *, unsigned> function_ids_;
+    vector<unsigned> callee_offsets_, callees_, callers_;
+    vector<unsigned> caller_offsets_, caller_edges_;
+
+    // Address-taken functions, by function number, the possible callees of
+    // indirect calls. Their addresses are taken in the global initializers,
+    // read by startCalls, or in the bodies, read by addCalls one at a time, so
+    // that bodies can be released once added. The calls having no !callees
+    // metadata are kept, in module order, until finishCalls knows them all.
+    struct IndirectCall {
+        unsigned caller;
+        const FunctionType *type;
+        double lfreq;
+    };
+    BitVector address_taken_;
+    vector<IndirectCall> indirect_calls_;
+
+    // Position of each function in the topological order of its SCC.
+    vector<unsigned> order_index_;
+
+    BitVector back_edges_;
+    vector<double> lfreqs_, back_edge_prob_; // Indexed by edge.
+    vector<double> root_freqs_; // Calls of each function from the virtual root.
+    vector<double> cfreqs_; // Call frequency of each function.
+    vector<double> gfreqs_; // Global call frequency of Fi calling Fj (Fi -> Fj), indexed by edge.
+};
+
+/// FunctionCallFrequencyAnalysis - Algorithm 3 as a module analysis. The local
+/// block frequencies are the cached results of algorithm 2 on the function
+/// analysis manager of the module.
+struct FunctionCallFrequencyAnalysis : AnalysisInfoMixin<FunctionCallFrequencyAnalysis> {
+    typedef FunctionCallFrequencyPass Result;
+
+    Result run(Module &module, ModuleAnalysisManager &mam) {
+        FunctionAnalysisManager &fam = mam.getResult<FunctionAnalysisManagerModuleProxy>(module).getManager();
+        DenseMap<Function *, BlockEdgeFrequencyPass *> function_block_edge_frequency_results {};
+        function_block_edge_frequency_results.reserve(module.size());
+        for (Function &func : module)
+            if (!func.isDeclaration())
+                function_block_edge_frequency_results[&func] = &fam.getResult<BlockEdgeFrequencyAnalysis>(func);
+
+        Result result;
+        result.run(module, function_block_edge_frequency_results);
+        return result;
+    }
 
 private:
-    void propagate_call_freq(Function *f, Function *head, bool is_final);
-
-    // Previous passes results.
-    map<Function *, BranchPredictionPass *> *function_branch_prediction_results_;
-    map<Function *, BlockEdgeFrequencyPass *> *function_block_edge_frequency_results_;
-
-    map<Function *, set<Function *>> reachable_functions_;
-    set<Edge> back_edges_;
-    map<Function *, bool> visited_functions_;
-    map<Edge, double> lfreqs_, back_edge_prob_;
-    map<Function *, double> cfreqs_; // Call frequency of each function.
-    map<Edge, double> gfreqs_; // Global call frequency of Fi calling Fj (Fi -> Fj).
+    friend AnalysisInfoMixin<FunctionCallFrequencyAnalysis>;
+    static AnalysisKey Key;
 };
 
+AnalysisKey FunctionCallFrequencyAnalysis::Key;
+
 /*
    Input:
    * A call graph, each node of which is a procedure and
@@ -51,153 +176,484 @@ private:
           propagate_call_freq(f, f, false);
    3. mark all nodes reachable from entry func as not visited and others as visited;
    4. propagate_call_freq(entry_func, entry_func, true);
+
+   The entry func is a virtual root calling main once, or calling each of the
+   roots given, or the externally visible functions of a library, as many
+   times as their weight. Its calls are the initial frequencies of step 4.
+
+   Loops of the call graph (recursion) never leave a strongly connected component,
+   so the steps are run one SCC at a time, callers before callees, using
+   scc_iterator over the call edges found, indirect ones included. Within an
+   SCC, the depth-first search finds the back edges and a topological order of
+   the remaining edges, over which propagate_call_freq is a single sweep. Every
+   call edge is visited a constant number of times, except for the SCCs holding
+   more than one loop head, which are swept once per head.
  */
-PreservedAnalyses FunctionCallFrequencyPass::run(Module &module) {
-    CallGraph cg {module};
-    Function *entry_func = module.getFunction("main");
+PreservedAnalyses FunctionCallFrequencyPass::run(
+    Module &module, const DenseMap<Function *, BlockEdgeFrequencyPass *> &function_block_edge_frequency_results) {
+    startCalls(module);
+    for (Function &func : module) {
+        auto results = function_block_edge_frequency_results.find(&func);
+        if (results != function_block_edge_frequency_results.end()) // Declarations have none.
+            addCalls(func, *results->second);
+    }
+    return finishCalls();
+}
 
+/// finishCalls - Propagate the call frequencies over the call graph built by
+/// addCalls.
+PreservedAnalyses FunctionCallFrequencyPass::finishCalls() {
+    PredictionTimer timer {"FunctionCallFrequency", "Function call frequencies (A3)"};
     {// Step.1.
-        for (Function &func : module) {
-            visited_functions_[&func] = false;
-            set<Function *> reachable_nodes = {}; // Graph nodes (functions) reachable by func.
-            for (BasicBlock &bb : func) {
-                for (Instruction &instr : bb) {
-                    if (auto *call = dyn_cast<CallInst>(&instr)) {// Find call instructions.
-                        if (!call->getCalledFunction()) continue; // Calls from pointers cannot be resolved here!
-                        Edge edge = make_pair(&func, call->getCalledFunction());
-                        lfreqs_[edge] = lfreqs_[edge] + // Add block's frequency to edge.
-                            function_block_edge_frequency_results_[0][&func]->getBlockFrequency(&bb);
-                        reachable_nodes.insert(call->getCalledFunction());
-                    }
-                }
-            }
-            reachable_functions_[&func] = reachable_nodes;
-        }
+        add_indirect_calls();
+        index_callers();
         back_edge_prob_ = lfreqs_;
     }
-    {// Step.2.
-        vector<Function *> dfs_functions = {};
-        set<Function *> loop_heads = {};
-
-        {// Build a list of functions reached from entry_func.
-            vector<Function *> visited_stack = {}; // Detect recursion.
-            dfs_functions.push_back(entry_func); // Start dfs from entry function.
-            std::function<void(Function *)> dfs;
-            dfs = [&](Function *foo) -> void {
-                visited_stack.push_back(foo);
-                for (Function *calledFunction : reachable_functions_[foo]) {
-                    auto found = find(dfs_functions.begin(), dfs_functions.end(), calledFunction);
-                    if (found == dfs_functions.end()) {
-                        dfs_functions.push_back(calledFunction);
-                        dfs(calledFunction);
-                    } else {// Check if it is a loop.
-                        for (auto f = visited_stack.rbegin(); f != visited_stack.rend(); ++f) {
-                            if (*f == calledFunction) {
-                                //errs() << "DETECTED LOOP: " << foo->getName() << " calls " << f[0]->getName() << "\n";
-                                loop_heads.insert(*f);
-                                back_edges_.insert(make_pair(foo, *f));
-                            }
-                        }
-                    }
-                }
-                visited_stack.pop_back();
-            };
-            dfs(dfs_functions.front());
+
+    // SCCs of the call graph, callees before callers. The root comes last, in
+    // an SCC of its own.
+    vector<vector<unsigned>> sccs = {};
+    {
+        vector<unsigned> all(functions_.size());
+        std::iota(all.begin(), all.end(), 0);
+        vector<CallNode> nodes(functions_.size() + 1);
+        for (unsigned f = 0; f < functions_.size(); ++f)
+            nodes[f] = {makeArrayRef(callees_).slice(callsBegin(f), callsEnd(f) - callsBegin(f)), nodes.data()};
+        const CallNode *root = &nodes.back();
+        nodes.back() = {all, nodes.data()};
+        for (auto I = scc_begin(root); !I.isAtEnd(); ++I) {
+            vector<unsigned> scc = {};
+            for (const CallNode *node : *I)
+                if (node != root)
+                    scc.push_back(node - nodes.data());
+            if (!scc.empty()) sccs.push_back(std::move(scc));
         }
+    }
+
+    for (auto scc = sccs.rbegin(); scc != sccs.rend(); ++scc) {
+        vector<unsigned> order = {}, heads = {};
+        find_back_edges(*scc, order, heads);
+
+        // Step.2. Foreach loop head in reverse depth-first order.
+        for (auto head = heads.rbegin(); head != heads.rend(); ++head)
+            propagate_loop(order, *head);
+
+        // Step.3 and 4.
+        propagate_call_freq(order);
+    }
 
 /*
-        for (auto &edge : back_edges_) {// Print back edges found.
-            errs() << "Back edge [" << edge.first->getName() << " -> " << edge.second->getName() << "]\n";
-        }
+    for (unsigned e = 0; e < callees_.size(); ++e) {// Print back edges found.
+        if (back_edges_.test(e))
+            errs() << "Back edge [" << functions_[callers_[e]]->getName() << " -> "
+                   << functions_[callees_[e]]->getName() << "]\n";
+    }
 */
-        // Foreach function f in reverse depth-first order do.
-        for (auto f = dfs_functions.rbegin(); f != dfs_functions.rend(); ++f) {
-            auto it = loop_heads.find(*f);
-            if (it != loop_heads.end()) {
-                Function *loop = *it;
-                auto &reachable = reachable_functions_[loop]; // Nodes reachable from f.
-                // Mark nodes reachable from f as not visited (false), and all others as visited (true).
-                for (auto jt = visited_functions_.begin(); jt != visited_functions_.end(); ++jt) {
-                    jt->second = !(reachable.find(jt->first) != reachable.end());
-                }
-                // Mark f as not visited.
-                visited_functions_[loop] = false;
-                propagate_call_freq(loop, loop, false);
+    // The block frequencies are left local, see getGlobalBlockFrequency.
+    return PreservedAnalyses::all();
+}
+
+/// invalidate - The call graph and the local frequencies are read from the
+/// bodies of the functions, so the result is kept only when explicitly preserved.
+bool FunctionCallFrequencyPass::invalidate(Module &, const PreservedAnalyses &pa,
+                                           ModuleAnalysisManager::Invalidator &) {
+    auto checker = pa.getChecker<FunctionCallFrequencyAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Module>>());
+}
+
+/// startCalls - Number the functions of the module, and start with no call
+/// edges.
+void FunctionCallFrequencyPass::startCalls(Module &module) {
+    functions_.clear();
+    function_ids_.clear();
+    for (Function &func : module) {
+        function_ids_[&func] = functions_.size();
+        functions_.push_back(&func);
+    }
+
+    callee_offsets_.clear();
+    callees_.clear();
+    callers_.clear();
+    lfreqs_.clear();
+    address_taken_.clear();
+    address_taken_.resize(functions_.size());
+    indirect_calls_.clear();
+    if (indirect_calls_opt) {
+        SmallPtrSet<const Constant *, 32> visited {};
+        for (const GlobalVariable &var : module.globals())
+            if (var.hasInitializer())
+                mark_address_taken(var.getInitializer(), visited);
+        for (const GlobalAlias &alias : module.aliases())
+            mark_address_taken(alias.getAliasee(), visited);
+        for (const GlobalIFunc &ifunc : module.ifuncs())
+            mark_address_taken(ifunc.getResolver(), visited);
+        for (const Function *func : functions_) // Personalities, prefix and prologue data.
+            for (const Value *op : func->operands())
+                mark_address_taken(op, visited);
+    }
+
+    // While all the bodies are still there.
+    find_roots(module);
+}
+
+/// addCalls - Build the call edges of a function with their local call
+/// frequencies, and mark the functions whose address it takes. The frequency
+/// of an indirect call is split evenly among its possible callees, by
+/// finishCalls for the calls without !callees metadata.
+void FunctionCallFrequencyPass::addCalls(Function &func, const BlockEdgeFrequencyPass &local) {
+    PredictionTimer timer {"FunctionCallFrequency", "Function call frequencies (A3)", &func};
+    unsigned f = function_ids_[&func];
+    assert(callee_offsets_.size() <= f && "Functions must be added once, in module order!");
+    while (callee_offsets_.size() <= f) // The functions skipped have no calls.
+        callee_offsets_.push_back(callees_.size());
+
+    DenseMap<const Function *, unsigned> edges; // Edges from func, by callee.
+    auto add_call = [&](const Function *callee, double lfreq) {
+        auto edge = edges.insert(make_pair(callee, (unsigned) callees_.size()));
+        if (edge.second) {
+            callees_.push_back(function_ids_[callee]);
+            callers_.push_back(f);
+            lfreqs_.push_back(0);
+        }
+        lfreqs_[edge.first->second] += lfreq;
+    };
+    SmallVector<const Function *, 4> indirect_callees;
+    SmallPtrSet<const Constant *, 32> visited {};
+    for (BasicBlock &bb : func) {
+        for (Instruction &instr : bb) {
+            auto *call = dyn_cast<CallBase>(&instr); // Calls, invokes and callbrs.
+            if (indirect_calls_opt) {
+                for (const Use &op : instr.operands())
+                    if (!(call && call->isCallee(&op) && isa<Function>(op.get())))
+                        mark_address_taken(op.get(), visited);
+            }
+            if (!call)
+                continue;
+            // Add block's frequency to edge.
+            double bfreq = local.getBlockFrequency(&bb);
+            if (const Function *callee = call->getCalledFunction()) {
+                add_call(callee, bfreq);
+                continue;
+            }
+
+            indirect_callees.clear();
+            if (indirect_calls_opt && !call->isInlineAsm() && !find_listed_callees(*call, indirect_callees)) {
+                indirect_calls_.push_back({f, call->getFunctionType(), bfreq});
+                continue;
             }
+            if (indirect_callees.empty()) {
+                ++NumIndirectCallsSkipped;
+                continue;
+            }
+            ++NumIndirectCallsResolved;
+            for (const Function *callee : indirect_callees)
+                add_call(callee, bfreq / indirect_callees.size());
         }
     }
-    {// Step.3.
-        auto &reachable = reachable_functions_[entry_func];
-        for (auto jt = visited_functions_.begin(); jt != visited_functions_.end(); ++jt) {
-            jt->second = !(reachable.find(jt->first) != reachable.end());
+}
+
+/// index_callers - Build the reverse edge index.
+void FunctionCallFrequencyPass::index_callers() {
+    NumCallEdges += callees_.size();
+
+    // Reverse edge index, by counting sort on the callees.
+    caller_offsets_.assign(functions_.size() + 1, 0);
+    for (unsigned callee : callees_)
+        ++caller_offsets_[callee + 1];
+    for (unsigned f = 0; f < functions_.size(); ++f)
+        caller_offsets_[f + 1] += caller_offsets_[f];
+    caller_edges_.assign(callees_.size(), 0);
+    vector<unsigned> next(caller_offsets_.begin(), caller_offsets_.end() - 1);
+    for (unsigned e = 0; e < callees_.size(); ++e)
+        caller_edges_[next[callees_[e]]++] = e;
+
+    back_edges_.clear();
+    back_edges_.resize(callees_.size());
+    gfreqs_.assign(callees_.size(), 0);
+    cfreqs_.assign(functions_.size(), 0);
+    order_index_.assign(functions_.size(), 0);
+}
+
+/// mark_address_taken - Mark the functions found in a constant, or an operand
+/// of an instruction other than the callee of a call, whose address is thus
+/// taken, as Function::hasAddressTaken finds them. The initializers of global
+/// values are read by startCalls, so globals are not looked into.
+void FunctionCallFrequencyPass::mark_address_taken(const Value *value, SmallPtrSetImpl<const Constant *> &visited) {
+    auto *constant = dyn_cast<Constant>(value);
+    if (!constant || isa<ConstantData>(constant) || isa<BlockAddress>(constant) || !visited.insert(constant).second)
+        return;
+    if (auto *func = dyn_cast<Function>(constant)) {
+        auto found = function_ids_.find(func);
+        if (found != function_ids_.end())
+            address_taken_.set(found->second);
+    } else if (!isa<GlobalValue>(constant)) {
+        for (const Value *op : constant->operands())
+            mark_address_taken(op, visited);
+    }
+}
+
+/// find_listed_callees - The possible callees of an indirect call given by
+/// its !callees metadata. Returns false for calls having none, whose possible
+/// callees are the address-taken functions of their type.
+bool FunctionCallFrequencyPass::find_listed_callees(const CallBase &call,
+                                                    SmallVectorImpl<const Function *> &callees) {
+    MDNode *metadata = call.getMetadata(LLVMContext::MD_callees);
+    if (!metadata)
+        return false;
+    for (const MDOperand &op : metadata->operands())
+        if (auto *callee = mdconst::dyn_extract_or_null<Function>(op))
+            if (function_ids_.count(callee) && !is_contained(callees, callee))
+                callees.push_back(callee);
+    return true;
+}
+
+/// add_indirect_calls - Close the call edges. Then split the frequency of the
+/// indirect calls kept by addCalls among the address-taken functions of their
+/// type, now that every body has been read, merging their edges into those of
+/// their callers.
+void FunctionCallFrequencyPass::add_indirect_calls() {
+    while (callee_offsets_.size() <= functions_.size())
+        callee_offsets_.push_back(callees_.size());
+    if (indirect_calls_.empty())
+        return;
+
+    // Possible callees, by type, in module order.
+    DenseMap<const FunctionType *, SmallVector<unsigned, 4>> address_taken {};
+    for (unsigned f : address_taken_.set_bits())
+        address_taken[functions_[f]->getFunctionType()].push_back(f);
+
+    vector<unsigned> offsets(1, 0), callees {}, callers {};
+    vector<double> lfreqs {};
+    DenseMap<unsigned, unsigned> edges {}; // Edges from the caller, by callee.
+    auto call = indirect_calls_.begin();
+    for (unsigned f = 0; f < functions_.size(); ++f) {
+        edges.clear();
+        auto add_call = [&](unsigned callee, double lfreq) {
+            auto edge = edges.insert(make_pair(callee, (unsigned) callees.size()));
+            if (edge.second) {
+                callees.push_back(callee);
+                callers.push_back(f);
+                lfreqs.push_back(0);
+            }
+            lfreqs[edge.first->second] += lfreq;
+        };
+        for (unsigned e = callsBegin(f); e != callsEnd(f); ++e)
+            add_call(callees_[e], lfreqs_[e]);
+        for (; call != indirect_calls_.end() && call->caller == f; ++call) {
+            auto found = address_taken.find(call->type);
+            if (found == address_taken.end()) {
+                ++NumIndirectCallsSkipped;
+                continue;
+            }
+            ++NumIndirectCallsResolved;
+            for (unsigned callee : found->second)
+                add_call(callee, call->lfreq / found->second.size());
         }
-        visited_functions_[entry_func] = false;
+        offsets.push_back(callees.size());
+    }
+
+    callee_offsets_.swap(offsets);
+    callees_.swap(callees);
+    callers_.swap(callers);
+    lfreqs_.swap(lfreqs);
+    vector<IndirectCall>().swap(indirect_calls_);
+}
+
+/// find_roots - Find the calls of each function from the virtual root: one
+/// call of main, or the given roots, plus the externally visible functions in
+/// library mode, or without main.
+void FunctionCallFrequencyPass::find_roots(Module &module) {
+    root_freqs_.assign(functions_.size(), 0);
+
+    vector<std::string> roots(roots_opt.begin(), roots_opt.end());
+    if (!roots_file_opt.empty()) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(roots_file_opt);
+        if (!buffer)
+            errs() << "WARNING! Cannot read --prediction-roots-file=" << roots_file_opt << ": "
+                   << buffer.getError().message() << "\n";
+        else
+            for (line_iterator I(**buffer, true, '#'); !I.is_at_end(); ++I)
+                roots.push_back(I->trim().str());
     }
-    {// Step.4.
-        propagate_call_freq(entry_func, entry_func, true);
+
+    Function *main = module.getFunction("main");
+    bool has_main = main && !main->isDeclaration();
+    if (library_opt || (roots.empty() && !has_main)) {
+        for (unsigned f = 0; f < functions_.size(); ++f)
+            if (!functions_[f]->isDeclaration() && !functions_[f]->hasLocalLinkage())
+                root_freqs_[f] = 1;
+    } else if (roots.empty()) {
+        root_freqs_[function_ids_[main]] = 1;
     }
 
-    // Sum incoming cfreqs for functions not propagated to.
-    for (Function &func : module) {
-        if (cfreqs_.find(&func) == cfreqs_.end()) {
-            for (auto reachables : reachable_functions_) {
-                if (&func != reachables.first && (reachables.second.find(&func) != reachables.second.end())) {
-                    Edge edge = make_pair(reachables.first, &func);
-                    cfreqs_[&func] += gfreqs_[edge];
-                }
+    for (StringRef root : roots) {
+        StringRef name = root, weight_text;
+        double weight = 1;
+        if (root.contains(':')) {
+            std::tie(name, weight_text) = root.rsplit(':');
+            if (weight_text.trim().getAsDouble(weight) || weight < 0) {
+                errs() << "WARNING! Invalid weight in root '" << root << "', using 1 instead.\n";
+                weight = 1;
             }
         }
-    }
-    // Finally, multiply block freqs by cfreqs.
-    for (auto freq : cfreqs_) {
-        for (BasicBlock &bb : *freq.first) {
-            function_block_edge_frequency_results_[0][freq.first]->updateBlockFrequency(&bb, freq.second);
+        Function *func = module.getFunction(name.trim());
+        if (!func) {
+            errs() << "WARNING! Unknown root function '" << name.trim() << "', ignoring it.\n";
+            continue;
         }
+        root_freqs_[function_ids_[func]] = weight;
     }
-
-    return PreservedAnalyses::all();
 }
 
-void FunctionCallFrequencyPass::propagate_call_freq(Function *f, Function *head, bool is_final) {
-    const double epsilon = 0.000001;
+/// find_back_edges - Depth-first search restricted to one SCC. The search starts
+/// from the functions called from outside of the SCC, the virtual root
+/// included, so that they become the loop heads. Marks the back edges, and
+/// returns the SCC functions in reverse post-order (a topological order once
+/// back edges are removed) and the loop heads in depth-first order.
+void FunctionCallFrequencyPass::find_back_edges(const vector<unsigned> &scc,
+                                                vector<unsigned> &order, vector<unsigned> &heads) {
+    const unsigned NEW = 0, ON_STACK = 1, DONE = 2;
+    SmallDenseMap<unsigned, unsigned, 8> state;
+    for (unsigned f : scc) state[f] = NEW;
 
-    if (visited_functions_[f]) return;
+    vector<unsigned> roots = {};
+    for (unsigned f : scc) {
+        if (root_freqs_[f]) {
+            roots.push_back(f);
+            continue;
+        }
+        for (unsigned c = caller_offsets_[f]; c != caller_offsets_[f + 1]; ++c)
+            if (!state.count(callers_[caller_edges_[c]])) {
+                roots.push_back(f);
+                break;
+            }
+    }
+    roots.insert(roots.end(), scc.begin(), scc.end());
 
-    {// 1. Find cfreq(f).
-        vector<Function *> fpreds = {}; // Predecessors of f.
-        for (auto it = reachable_functions_.begin(); it != reachable_functions_.end(); ++it)
-            if (it->second.find(f) != it->second.end()) {// f is called by it->first.
-                Function *fp = it->first;
-                Edge fp_f = make_pair(fp, f);
-                if (!visited_functions_[fp] && (back_edges_.find(fp_f) == back_edges_.end())) return;
-                fpreds.push_back(it->first);
+    SmallPtrSet<const Function *, 8> is_head = {};
+    vector<pair<unsigned, unsigned>> stack = {}; // Function and next edge to visit.
+    for (unsigned root : roots) {
+        if (state[root] != NEW) continue;
+        state[root] = ON_STACK;
+        stack.push_back(make_pair(root, callee_offsets_[root]));
+        while (!stack.empty()) {
+            unsigned f = stack.back().first;
+            unsigned &e = stack.back().second;
+            if (e == callee_offsets_[f + 1]) {
+                state[f] = DONE;
+                order.push_back(f);
+                stack.pop_back();
+                continue;
+            }
+            unsigned fi = callees_[e++];
+            auto found = state.find(fi);
+            if (found == state.end()) continue; // Leaves the SCC.
+            if (found->second == ON_STACK) {// Check if it is a loop.
+                //errs() << "DETECTED LOOP: " << functions_[f]->getName() << " calls " << functions_[fi]->getName() << "\n";
+                back_edges_.set(e - 1);
+                if (is_head.insert(functions_[fi]).second)
+                    heads.push_back(fi);
+            } else if (found->second == NEW) {
+                found->second = ON_STACK;
+                stack.push_back(make_pair(fi, callee_offsets_[fi]));
             }
+        }
+    }
+    std::reverse(order.begin(), order.end());
+    for (unsigned i = 0; i < order.size(); ++i)
+        order_index_[order[i]] = i;
+}
+
+/// propagate_loop - Propagate call frequencies from a loop head, as executed
+/// once, to find the probability of each back edge reaching it. Only the
+/// functions after the head in the topological order can be reached from it
+/// without crossing a back edge.
+void FunctionCallFrequencyPass::propagate_loop(const vector<unsigned> &order, unsigned head) {
+    unsigned first = order_index_[head];
+    for (unsigned i = first; i < order.size(); ++i) {
+        unsigned f = order[i];
         cfreqs_[f] = (f == head ? 1 : 0);
-        double cyclic_probability = 0;
-        for (auto fp : fpreds) {
-            Edge fp_f = make_pair(fp, f);
-            if (is_final && (back_edges_.find(fp_f) != back_edges_.end()))
-                cyclic_probability += back_edge_prob_[fp_f];
-            else if (back_edges_.find(fp_f) == back_edges_.end())
-                cfreqs_[f] += gfreqs_[fp_f];
+        for (unsigned c = caller_offsets_[f]; c != caller_offsets_[f + 1]; ++c) {
+            unsigned edge = caller_edges_[c];
+            unsigned fp = callers_[edge];
+            if (back_edges_.test(edge)) continue;
+            // Only callers inside the SCC and after the head carry frequency.
+            if (order_index_[fp] >= order.size() || order[order_index_[fp]] != fp || order_index_[fp] < first) continue;
+            cfreqs_[f] += gfreqs_[edge];
         }
-        if (cyclic_probability > 1 - epsilon) cyclic_probability = 1 - epsilon;
-        cfreqs_[f] = cfreqs_[f] / (1.0 - cyclic_probability);
-    }
-    {// 2. Calculate global call frequencies for f's out edges.
-        visited_functions_[f] = true;
-        for (auto fi : reachable_functions_[f]) {
-            Edge f_fi = make_pair(f, fi);
-            gfreqs_[f_fi] = lfreqs_[f_fi] * cfreqs_[f];
-            if (fi == head && !is_final) back_edge_prob_[f_fi] = lfreqs_[f_fi] * cfreqs_[f];
+        for (unsigned edge = callee_offsets_[f]; edge != callee_offsets_[f + 1]; ++edge) {
+            gfreqs_[edge] = lfreqs_[edge] * cfreqs_[f];
+            if (callees_[edge] == head) back_edge_prob_[edge] = gfreqs_[edge];
         }
     }
-    {// 3. Propagate to successor nodes.
-        for (auto fi : reachable_functions_[f]) {
-            Edge f_fi = make_pair(f, fi);
-            if (back_edges_.find(f_fi) == back_edges_.end()) {
-                propagate_call_freq(fi, head, is_final);
+}
+
+/// propagate_call_freq - Final propagation over one SCC, in topological order.
+/// All callers outside of the SCC already have their global call frequencies.
+void FunctionCallFrequencyPass::propagate_call_freq(const vector<unsigned> &order) {
+    const double epsilon = 0.000001;
+
+    for (unsigned f : order) {
+        {// 1. Find cfreq(f).
+            cfreqs_[f] = root_freqs_[f];
+            double cyclic_probability = 0;
+            for (unsigned c = caller_offsets_[f]; c != caller_offsets_[f + 1]; ++c) {
+                unsigned edge = caller_edges_[c];
+                if (back_edges_.test(edge))
+                    cyclic_probability += back_edge_prob_[edge];
+                else
+                    cfreqs_[f] += gfreqs_[edge];
+            }
+            if (cyclic_probability > 1 - epsilon) {
+                cyclic_probability = 1 - epsilon;
+                ++NumRecursionClamps;
             }
+            cfreqs_[f] = cfreqs_[f] / (1.0 - cyclic_probability);
+        }
+        {// 2. Calculate global call frequencies for f's out edges.
+            for (unsigned edge = callee_offsets_[f]; edge != callee_offsets_[f + 1]; ++edge)
+                gfreqs_[edge] = lfreqs_[edge] * cfreqs_[f];
         }
     }
 }
+
+/// getCallFrequency - Invocation frequency of a function, cfreq(f).
+double FunctionCallFrequencyPass::getCallFrequency(const Function *f) const {
+    auto found = function_ids_.find(f);
+    return found != function_ids_.end() ? cfreqs_[found->second] : 0.0;
+}
+
+/// getFunctionId - Get the number of a function, or ~0U if it is not part of
+/// the module.
+unsigned FunctionCallFrequencyPass::getFunctionId(const Function *f) const {
+    auto found = function_ids_.find(f);
+    return found != function_ids_.end() ? found->second : ~0U;
+}
+
+/// getGlobalCallFrequency - Global call frequency of caller calling callee,
+/// gfreq(caller -> callee).
+double FunctionCallFrequencyPass::getGlobalCallFrequency(const Function *caller, const Function *callee) const {
+    auto found = function_ids_.find(caller);
+    if (found == function_ids_.end()) return 0.0;
+    unsigned f = found->second;
+    for (unsigned edge = callee_offsets_[f]; edge != callee_offsets_[f + 1]; ++edge)
+        if (functions_[callees_[edge]] == callee)
+            return gfreqs_[edge];
+    return 0.0;
+}
+
+/// getGlobalBlockFrequency - Frequency of a basic block over the whole program:
+/// its local frequency, from algorithm 2, times the invocation frequency of its
+/// function.
+double FunctionCallFrequencyPass::getGlobalBlockFrequency(const BlockEdgeFrequencyPass &local,
+                                                          const BasicBlock *bb) const {
+    return local.getBlockFrequency(bb) * getFrequencyScale(bb->getParent());
+}
+
+/// getFrequencyScale - Factor turning the local frequencies of a function into
+/// global ones: its invocation frequency. Functions never invoked keep their
+/// local frequencies.
+double FunctionCallFrequencyPass::getFrequencyScale(const Function *f) const {
+    double cfreq = getCallFrequency(f);
+    return cfreq ? cfreq : 1.0;
+}